@@ -0,0 +1,57 @@
+/*
+    EdgeCapture.h - Latched edge capture for the OpenPLC discrete inputs
+*/
+#include <Arduino.h>
+#include "Modbus.h"
+
+#ifndef EDGECAPTURE_H
+#define EDGECAPTURE_H
+
+//Watch captured inputs through the pin change interrupts, which takes the
+//PCINT0..2 vectors. Without it only pins with an external interrupt can
+//be captured and the vectors are left to the sketch. AVR only, and not
+//with USE_SOFTWARE_SERIAL, which owns the PCINT vectors itself.
+#define USE_PIN_CHANGE
+
+//Inputs sampled once per loop() miss pulses shorter than the scan. Inputs
+//picked for capture are also watched by the pin change (PCINTx) or
+//external (INTx) interrupt of their pin. An edge seen there is latched and
+//the input keeps reporting it until the master has read it:
+//
+//  rising latch    a high pulse reads as 1 even if it is already over
+//  falling latch   a low pulse reads as 0 even if it is already over
+//
+//After an accepted edge the input ignores further changes for the
+//debounce time, a level that is still different once it expires counts as
+//the next edge. Pins with neither interrupt are left to the normal scan.
+class EdgeCapture {
+    private:
+        const uint8_t* _pins;
+        uint8_t _count;             // captured inputs
+        uint8_t* _input;            // input number of each captured input
+        volatile uint8_t** _reg;    // its PINx register
+        uint8_t* _mask;             // and bit
+        unsigned long* _edgeTime;   // micros() of the last accepted edge
+        unsigned long _debounce;
+        uint32_t _latchRising;
+        uint32_t _latchFalling;
+        volatile uint32_t _level;   // debounced level, by input number
+        volatile uint32_t _rise;    // latched edges not yet read
+        volatile uint32_t _fall;
+        uint32_t _shownRise;        // latches published by the last scan
+        uint32_t _shownFall;
+        word _firstReg;
+
+        void sample();
+
+    public:
+        EdgeCapture();
+        void begin(const uint8_t* pins, uint8_t count, uint32_t latchRising, uint32_t latchFalling,
+                   unsigned long debounceUs = 0, word firstReg = 0);
+        void scan();
+        bool apply(uint8_t input, bool level);
+        void read(word offset, word numregs);
+        void isr();
+};
+
+#endif //EDGECAPTURE_H
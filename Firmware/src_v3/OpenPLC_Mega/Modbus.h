@@ -8,7 +8,8 @@
 #define MODBUS_H
 
 #define MAX_REGS     32
-#define MAX_FRAME   128
+#define MAX_FRAME   256                 // largest RTU ADU
+#define MAX_PDU     (MAX_FRAME - 3)     // ADU minus address and CRC
 //#define USE_HOLDING_REGISTERS_ONLY
 
 typedef unsigned int u_int;
@@ -23,8 +24,42 @@ enum {
     MB_FC_WRITE_REG        = 0x06, // Preset Single Register 4xxxx
     MB_FC_WRITE_COILS      = 0x0F, // Write Multiple Coils (Outputs) 0xxxx
     MB_FC_WRITE_REGS       = 0x10, // Write block of contiguous registers 4xxxx
+    MB_FC_MASK_WRITE_REG   = 0x16, // AND/OR mask write of a register 4xxxx
+    MB_FC_READ_WRITE_REGS  = 0x17, // Write then read blocks of registers 4xxxx
+    MB_FC_READ_FIFO_QUEUE  = 0x18, // Read (and drain) a register FIFO
+    MB_FC_EXCHANGE_IMAGE   = 0x41, // Write all outputs, read all inputs (user defined)
+    MB_FC_READ_CHANGES     = 0x42, // Read inputs changed since a sequence number (user defined)
+    MB_FC_SET_BAUD         = 0x43, // Switch the serial line speed (user defined, RTU)
 };
 
+//MB_FC_EXCHANGE_IMAGE moves the whole process image in one round trip.
+//Every table is transferred from its first register on.
+//  Request: fc, coil count (2), hreg count (2), coil bytes, hreg words
+//  Reply:   fc, ists count (2), ireg count (2), ists bytes, ireg words
+//Bits are packed LSB first as in FC01/FC15, words are big endian. The
+//outputs are written before the inputs are read. A count of 0 leaves that
+//table untouched, a count larger than the table is an illegal address.
+//Offsets never added inside a table read as 0 and ignore what is written.
+//The host side is master/ModbusExchange.h.
+
+//MB_FC_READ_CHANGES returns only the inputs that changed since the master
+//last synced. Each input table counts its commits that changed something,
+//every register keeps the count at its last change.
+//  Request: fc, start (2), count (2), table (1), epoch (2), since (2)
+//  Reply:   fc, epoch (2), sequence (2), next (2), pair count (1), pairs
+//table is the function code that reads it plainly (0x02 or 0x04), a pair
+//is address (2) and value (2). since 0, or a sequence too old to compare,
+//returns every register of the range. When the pairs do not fit one
+//reply, next is where the master continues with the same since (always
+//past start), else it is start. The master then keeps the epoch and
+//sequence of the first reply for its next request. Sequences restart from
+//0 when the slave resets, so the sketch gives each boot its own epoch
+//(setEpoch()): a since from an epoch other than the current one returns
+//every register, even when the new sequence has already gone past it.
+//Input registers can be given a deadband (deadband()), in up to
+//MB_MAX_DEADBANDS ranges.
+#define MB_MAX_DEADBANDS    4
+
 //Exception Codes
 enum {
     MB_EX_ILLEGAL_FUNCTION = 0x01, // Function Code not Supported
@@ -40,52 +75,162 @@ enum {
     MB_REPLY_NORMAL = 0x03,
 };
 
-typedef struct TRegister {
-    word address;
-    word value;
-    struct TRegister* next;
-} TRegister;
+//Registers may also be updated from interrupt handlers (background analog
+//scan, edge capture), so on AVR a word or a shared bit byte is never
+//accessed half way through one. The I/O modules use the same guard for the
+//state they share with their ISRs.
+#ifdef __AVR__
+#define MB_ATOMIC_BEGIN byte _sreg = SREG; cli();
+#define MB_ATOMIC_END   SREG = _sreg;
+#else
+#define MB_ATOMIC_BEGIN
+#define MB_ATOMIC_END
+#endif
+
+//Register tables
+enum {
+    MB_TABLE_COILS  = 0x00, // Coils (Outputs) 0xxxx
+    MB_TABLE_ISTS   = 0x01, // Input Status (Discrete Inputs) 1xxxx
+    MB_TABLE_IREGS  = 0x02, // Input Registers 3xxxx
+    MB_TABLE_HREGS  = 0x03, // Holding Registers 4xxxx
+    MB_TABLE_COUNT  = 0x04,
+};
+
+//Contiguous register bank. Every table keeps its registers in one block that
+//covers the offsets first..last, so a lookup is a subtraction and a range
+//check is two compares. Coils and input status are packed one bit per
+//register, holding and input registers take one word each. Offsets left
+//between two added registers take space in the bank but are not
+//registers: added has a bit per offset and holes counts the clear ones, so
+//only a bank with holes pays for checking them and the master still gets
+//an illegal address for an offset that was never added. Keep each table
+//dense, a block spanning offsets far apart may not fit the RAM.
+//Every table is double buffered, commit() swaps them at the end of each
+//scan. The sketch and the ISRs update input data while the master reads
+//input image, so one reply never mixes two scans. The master writes output
+//data while the sketch applies output image, so one scan never mixes two
+//requests. Coils and holding registers also keep one dirty bit per
+//register, set when a commit changes the image, so the sketch only applies
+//the outputs that changed (see nextDirty()).
+//Inputs also keep the sequence number of the commit that last changed
+//each register, for MB_FC_READ_CHANGES. Input registers changed by less
+//than the deadband keep their old stamp, ref is the value it was set for.
+typedef struct TRegBank {
+    word  first;    // offset of the first register in the bank
+    word  last;     // offset of the last register in the bank
+    byte* data;     // register storage, 0 if the bank is empty
+    byte* added;    // offsets added as registers, one bit each
+    word  holes;    // offsets first..last not added
+    byte* dirty;    // changed registers, coils and holding registers only
+    byte* image;    // committed copy, read by the master for inputs and
+                    // by the sketch for outputs
+    word* stamp;    // sequence of the last change, inputs only
+    word* ref;      // value at the last change, input registers only
+    word  seq;      // sequence of the last commit that changed something
+    word  aged;     // next register checked for a stale stamp
+} TRegBank;
+
+//Register FIFO read with MB_FC_READ_FIFO_QUEUE. A producer (usually an
+//ISR) pushes at head, FC24 takes every value from tail. head and tail are
+//free running byte counters and the size a power of two, so neither side
+//ever needs the other to hold off interrupts.
+//As the spec asks, FC24 answers a FIFO holding more than 31 values with an
+//illegal data value, so a producer keeps at most MB_FIFO_MAX_LEN = 31 and
+//counts the rest as overruns. USE_FIFO_PARTIAL_READ lets FIFOs grow to 128
+//and FC24 return the oldest 31, leaving the rest for the next request.
+//That is not standard Modbus, the master has to read until the FIFO count
+//comes back below 31.
+//#define USE_FIFO_PARTIAL_READ
+#define MB_MAX_FIFOS        4
+#define MB_FIFO_MAX_READ    31
+#ifdef USE_FIFO_PARTIAL_READ
+#define MB_FIFO_MAX_LEN     128
+#else
+#define MB_FIFO_MAX_LEN     MB_FIFO_MAX_READ
+#endif
+
+typedef struct TRegFifo {
+    word* data;
+    byte  mask;                 // size - 1
+    volatile byte head;         // next slot to fill, producer only
+    volatile byte tail;         // next slot to read, FC24 only
+    volatile word overruns;     // values dropped because the FIFO was full
+} TRegFifo;
+
+//Called once a read request has been answered, with the table and the
+//range of registers that went into the reply
+typedef void (*TReadHook)(byte table, word offset, word numregs);
+
+//Called once a write request has been applied to the registers, before the
+//reply is sent, with the table and the range of registers written. Lets the
+//sketch drive the outputs so an acknowledged write has already switched.
+typedef void (*TWriteHook)(byte table, word offset, word numregs);
 
 class Modbus {
     private:
-        TRegister *_regs_head;
-        TRegister *_regs_last;
+        TRegBank _banks[MB_TABLE_COUNT];
+        TReadHook _onRead;
+        TWriteHook _onWrite;
+        word _deadband[MB_MAX_DEADBANDS];
+        word _deadFirst[MB_MAX_DEADBANDS];
+        word _deadLast[MB_MAX_DEADBANDS];
+        byte _numDeadbands;
+        word _epoch;
+        TRegFifo* _fifos[MB_MAX_FIFOS];
+        word _fifoAddr[MB_MAX_FIFOS];
+        byte _numFifos;
 
         void readRegisters(word startreg, word numregs);
         void writeSingleRegister(word reg, word value);
         void writeMultipleRegisters(byte* frame,word startreg, word numoutputs, byte bytecount);
-        void exceptionResponse(byte fcode, byte excode);
+        void maskWriteRegister(word reg, word andmask, word ormask);
+        void readWriteRegisters(byte* frame, word readreg, word numread);
+        void readFifoQueue(word address);
         #ifndef USE_HOLDING_REGISTERS_ONLY
             void readCoils(word startreg, word numregs);
             void readInputStatus(word startreg, word numregs);
             void readInputRegisters(word startreg, word numregs);
             void writeSingleCoil(word reg, word status);
             void writeMultipleCoils(byte* frame,word startreg, word numoutputs, byte bytecount);
+            void exchangeImage(byte* frame, word numcoils, word numregs);
+            void readChanges(byte* frame, word startreg, word numregs);
         #endif
 
-        TRegister* searchRegister(word addr);
+        bool searchRegister(byte table, word offset, word numregs = 1);
+        unsigned long bankSize(byte table);
 
-        void addReg(word address, word value = 0);
-        bool Reg(word address, word value);
-        word Reg(word address);
+        bool addReg(byte table, word offset, word value = 0);
+        bool Reg(byte table, word offset, word value);
+        word Reg(byte table, word offset);
 
     protected:
-        byte *_frame;
-        byte  _len;
+        byte *_frame;   // PDU being processed, the reply is built over it
+        word  _len;     // PDU length
         byte  _reply;
         void receivePDU(byte* frame);
+        void exceptionResponse(byte fcode, byte excode);
 
     public:
         Modbus();
 
-        void addHreg(word offset, word value = 0);
+        void onRead(TReadHook hook);
+        void onWrite(TWriteHook hook);
+        bool nextDirty(byte table, word &offset);
+        void commit();
+        void commit(byte table);
+        word Image(byte table, word offset);
+        bool addFifo(word address, TRegFifo* fifo);
+        bool deadband(word offset, word numregs, word value);
+        void setEpoch(word epoch);
+
+        bool addHreg(word offset, word value = 0);
         bool Hreg(word offset, word value);
         word Hreg(word offset);
 
         #ifndef USE_HOLDING_REGISTERS_ONLY
-            void addCoil(word offset, bool value = false);
-            void addIsts(word offset, bool value = false);
-            void addIreg(word offset, word value = 0);
+            bool addCoil(word offset, bool value = false);
+            bool addIsts(word offset, bool value = false);
+            bool addIreg(word offset, word value = 0);
 
             bool Coil(word offset, bool value);
             bool Ists(word offset, bool value);
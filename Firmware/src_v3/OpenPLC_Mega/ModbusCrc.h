@@ -0,0 +1,75 @@
+/*
+    ModbusCrc.h - CRC16 engines for ModbusSerial Library
+*/
+#include <Arduino.h>
+
+#ifndef MODBUSCRC_H
+#define MODBUSCRC_H
+
+//CRC engines. All of them produce the same CRC as the original table code:
+//
+//  MB_CRC_TABLE    two 256 byte tables, kept in flash (PROGMEM) on AVR.
+//                  512 bytes flash, no RAM. Fastest on 8 bit targets.
+//  MB_CRC_NIBBLE   one 16 word table, 32 bytes flash, two lookups per byte.
+//  MB_CRC_BITWISE  no table at all, eight shift/xor steps per byte.
+//  MB_CRC_SLICING  slicing-by-8, eight 256 word tables built in RAM (4 KB)
+//                  at startup. Meant for 32 bit/host builds that check
+//                  many frames, crcBlock() then consumes 8 bytes per step.
+#define MB_CRC_TABLE    1
+#define MB_CRC_NIBBLE   2
+#define MB_CRC_BITWISE  3
+#define MB_CRC_SLICING  4
+
+#ifndef MB_CRC_ENGINE
+#define MB_CRC_ENGINE   MB_CRC_TABLE
+#endif
+
+//The CRC is kept with the byte that goes first on the wire in the high
+//half, as the original table code did. The shift based engines work on the
+//usual reflected form, which is the same value with its bytes swapped.
+#define MB_CRC_SWAP(crc) ((word)(((crc) >> 8) | ((crc) << 8)))
+
+#if MB_CRC_ENGINE == MB_CRC_TABLE
+extern const byte _auchCRCHi[] PROGMEM;
+extern const byte _auchCRCLo[] PROGMEM;
+#elif MB_CRC_ENGINE == MB_CRC_NIBBLE
+extern const word _auchCRCNibble[] PROGMEM;
+#elif MB_CRC_ENGINE == MB_CRC_SLICING
+extern word _auchCRCSlice[8][256];
+#endif
+
+//Prepare the engine tables, if the engine needs any
+void crcInit();
+
+//Fold one byte into a running CRC started at 0xFFFF. The high byte of the
+//result is sent first.
+static inline word crcUpdate(word crc, byte b) {
+#if MB_CRC_ENGINE == MB_CRC_TABLE
+    byte Index = (crc >> 8) ^ b;
+    return ((word)((crc & 0xFF) ^ pgm_read_byte(&_auchCRCHi[Index])) << 8) |
+           pgm_read_byte(&_auchCRCLo[Index]);
+#elif MB_CRC_ENGINE == MB_CRC_NIBBLE
+    word s = MB_CRC_SWAP(crc) ^ b;
+    s = (s >> 4) ^ pgm_read_word(&_auchCRCNibble[s & 0x0F]);
+    s = (s >> 4) ^ pgm_read_word(&_auchCRCNibble[s & 0x0F]);
+    return MB_CRC_SWAP(s);
+#elif MB_CRC_ENGINE == MB_CRC_BITWISE
+    word s = MB_CRC_SWAP(crc) ^ b;
+    for (byte i = 0; i < 8; i++) {
+        if (s & 0x0001) s = (s >> 1) ^ 0xA001;
+        else s >>= 1;
+    }
+    return MB_CRC_SWAP(s);
+#elif MB_CRC_ENGINE == MB_CRC_SLICING
+    word s = MB_CRC_SWAP(crc);
+    s = (s >> 8) ^ _auchCRCSlice[0][(s ^ b) & 0xFF];
+    return MB_CRC_SWAP(s);
+#else
+#error "Unknown MB_CRC_ENGINE"
+#endif
+}
+
+//Fold a whole buffer into a running CRC
+word crcBlock(word crc, const byte* data, word len);
+
+#endif //MODBUSCRC_H
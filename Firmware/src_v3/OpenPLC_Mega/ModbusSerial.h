@@ -4,6 +4,7 @@
 */
 #include <Arduino.h>
 #include "Modbus.h"
+#include "ModbusCrc.h"
 
 #ifndef MODBUSSERIAL_H
 #define MODBUSSERIAL_H
@@ -12,10 +13,130 @@
 
 //#define DEBUG_MODE
 
+//Drive USART0 from its own RX interrupt instead of the core HardwareSerial,
+//so whole frames are assembled in a ring buffer sized for full 256 byte
+//ADUs. Uno/Mega only, Serial can't be used by the sketch when enabled.
+#define USE_USART_ISR
+
+//Learn t1.5 and t3.5 from the gaps seen inside live frames instead of
+//keeping the values for the baud, once the master turns it on with the
+//MB_CONFIG_TIMING register. Needs USE_USART_ISR.
+#define USE_ADAPTIVE_TIMING
+
 #ifdef USE_SOFTWARE_SERIAL
 #include <SoftwareSerial.h>
 #endif
 
+#if defined(USE_SOFTWARE_SERIAL) || defined(DEBUG_MODE) || \
+    !(defined(__AVR_ATmega328P__) || defined(__AVR_ATmega2560__))
+#undef USE_USART_ISR
+#endif
+
+#ifndef USE_USART_ISR
+#undef USE_ADAPTIVE_TIMING
+#endif
+
+#ifdef USE_USART_ISR
+//Receive ring size in bytes (power of two) and number of complete frames
+//it can queue while task() is busy
+#if defined(__AVR_ATmega2560__)
+#define MB_RX_RING      512
+#else
+#define MB_RX_RING      256
+#endif
+#define MB_RX_FRAMES    4
+
+//MB_FC_SET_BAUD switches the line speed at runtime.
+//  Request: fc, baud (4), timeout (2)
+//  Reply:   echo of the request, still at the old speed
+//The baud is in bits per second, big endian. It must come within
+//MB_BAUD_TOLERANCE of a rate the USART divisor can make (16 MHz: 100k,
+//125k, 200k, 250k, 500k, 1M and 2M are exact, 115200 is 2.1% off), else
+//the request is an illegal value. The slave switches once the reply is
+//out. If no good frame for it arrives at the new speed within timeout ms
+//it goes back to the old one, so a master that cannot follow does not
+//lose the slave. Sent to address 0 the whole bus switches at once. Rates
+//outside MB_BAUD_MIN...MB_BAUD_MAX are refused before any divisor is
+//worked out.
+//MB_BAUD_MAX is what the USART makes. Whether the receive interrupt keeps
+//up at a rate depends on the other interrupts of the sketch, so it is
+//proven on the board: a character lost to overrun breaks the frame, and
+//the new speed is only kept once a whole frame for this slave arrived at
+//it. MB_DIAG_OVERRUNS counts the characters lost later on. To keep the
+//interrupt short it only stores the byte and times it from Timer0, the
+//CRC is checked by task().
+#define MB_BAUD_TOLERANCE   25          // largest rate error accepted, per mille
+#define MB_BAUD_MIN         1200        // t3.5 and a character fit 16 bits of ticks
+#define MB_BAUD_MAX         (F_CPU / 8) // UBRR 0 at double speed
+#endif
+
+//The spec fixes t1.5 and t3.5 at 750 us and 1750 us above 19200 baud. Past
+//MB_BAUD_FIXED_MAX, speeds only reached by our own masters, they follow
+//the character time again, so a short 250 kbaud frame is not followed by
+//a gap five times longer than itself. MB_T15_MIN covers ISR latency and the 4 us
+//steps of micros().
+#define MB_BAUD_FIXED_MAX   115200
+#define MB_T15_MIN          100
+
+//The receive interrupt times each byte from the previous one's receive
+//complete, which is the silence between them plus one character. It
+//compares that against t1.5 and t3.5 plus one character, so both are
+//silences as in the spec.
+//Adaptive timing, off until the master writes 1 to MB_CONFIG_TIMING. t1.5
+//is set half again above the longest silence between two characters
+//lately (the interrupt to interrupt time less one character, that peak
+//decays by 1/16 per frame) and t3.5 two characters above t1.5. They grow
+//with the silences, up to MB_T15_MAX for masters behind USB adapters that
+//send a frame in bursts. They only go below the values for the baud once
+//MB_CALIBRATE_FRAMES good frames in a row have been seen, and never below
+//1.5 and 3.5 character times (at least MB_T15_MIN). A frame broken by a
+//silence past t1.5, or split by a t3.5 too short (bad CRC), raises them at
+//once: past the silence that broke it, at least back to the values for
+//the baud, and twice as far on every loss in a row.
+#define MB_CALIBRATE_FRAMES 8
+#define MB_T15_MAX          16000   // FTDI adapters hold bytes up to 16 ms
+
+//Diagnostic input registers, see diagnostics()
+enum {
+    MB_DIAG_T15        = 0, // t1.5 in use, us
+    MB_DIAG_T35        = 1, // t3.5 in use, us
+    MB_DIAG_GAP        = 2, // longest silence between characters lately, us
+    MB_DIAG_TURNAROUND = 3, // master silence after our last reply, us
+    MB_DIAG_OVERRUNS   = 4, // characters lost to receive overrun
+    MB_DIAG_REGS       = 5,
+};
+
+//Configuration holding registers, see diagnostics()
+enum {
+    MB_CONFIG_TIMING   = 0, // 1 lets t1.5 and t3.5 adapt, 0 keeps the values for the baud
+    MB_CONFIG_REGS     = 1,
+};
+
+//Address 0 is the broadcast, slave IDs are 1-247. A slave can also join
+//up to MB_MAX_GROUPS group addresses, best taken from 248-255 which the
+//spec reserves and no slave uses. Broadcast and group frames carry writes
+//only (FC05, FC06, FC15, FC16, FC22 and MB_FC_SET_BAUD), every slave
+//addressed applies them and none replies, so they never collide on the bus.
+#define MB_ADDRESS_BROADCAST    0
+#define MB_MAX_SLAVE_ID         247
+#define MB_MAX_GROUPS           4
+
+//Receiver states
+enum {
+    MB_RX_IDLE      = 0x00, // No frame in progress
+    MB_RX_RECEIVING = 0x01, // Bytes arriving, last one less than t1.5 ago
+    MB_RX_GAP       = 0x02, // Silence longer than t1.5, frame ends at t3.5
+};
+
+//Transmitter states
+enum {
+    MB_TX_IDLE      = 0x00, // Line free
+    MB_TX_DATA      = 0x01, // Sending the frame bytes
+    MB_TX_CRC_HI    = 0x02, // Sending the CRC computed on the way
+    MB_TX_CRC_LO    = 0x03,
+    MB_TX_DRAIN     = 0x04, // Last byte queued, waiting for TX complete
+};
+
 class ModbusSerial : public Modbus {
     private:
         Stream* _port;
@@ -28,18 +149,91 @@ class ModbusSerial : public Modbus {
         int   _txPin;
         unsigned int _t15; // inter character time out
         unsigned int _t35; // frame delay
+        bool  _diag;       // diagnostic registers added
+        word  _diagReg;
+        word  _configReg;
         byte  _slaveId;
+        byte  _groups[MB_MAX_GROUPS];
+        byte  _numGroups;
+        byte  _adu[MAX_FRAME]; // request/reply buffer, no allocation per frame
+        #ifdef USE_USART_ISR
+        byte  _rxRing[MB_RX_RING];
+        word  _rxEnds[MB_RX_FRAMES];     // ring index past each queued frame
+        volatile word  _rxHead;          // next free byte in the ring
+        volatile word  _rxStart;         // first byte of the open frame
+        volatile word  _rxTail;          // first byte of the oldest frame
+        volatile byte  _rxFrameHead;
+        volatile byte  _rxFrameTail;
+        volatile bool  _rxError;         // open frame broken, drop it
+        volatile word  _rxLast;          // Timer0 ticks of the last byte
+        volatile word  _rxOverruns;      // characters lost to receive overrun
+        word  _overrunsShown;            // last count put in MB_DIAG_OVERRUNS
+        word  _rxT15;                    // t1.5 and t3.5 plus one character,
+        word  _rxT35;                    // in ticks against the byte to byte time
+        word  _rxChar;                   // one character in ticks
+        volatile byte  _txState;
+        volatile word  _txPos;           // next byte of _adu to send
+        word  _txLen;
+        bool  _txAddCrc;
+        volatile word  _txCrc;
+        volatile unsigned long _txDone;  // micros() when the last reply ended
+        volatile uint8_t* _txPort;       // driver enable pin, 0 if unused
+        uint8_t _txMask;
+        long  _baudNew;                  // switch to once the reply is out, 0 if none
+        long  _baudOld;                  // fall back to, 0 once the switch is confirmed
+        word  _baudTimeout;              // ms to wait for a frame at the new speed
+        unsigned long _baudSince;        // millis() of the switch
+        #ifdef USE_ADAPTIVE_TIMING
+        unsigned int _t15Base;           // t1.5 and t3.5 for the baud, upper bounds
+        unsigned int _t35Base;
+        volatile word _rxGapMax;         // longest byte to byte ticks inside the open frame
+        volatile word _gapNew;           // longest gap of the frames closed since calibrate(), ticks
+        volatile byte _gapGood;          // good frames closed since calibrate()
+        volatile bool _gapBad;           // broken frame closed since calibrate()
+        volatile bool _txReplied;        // next frame start measures the turnaround
+        volatile word _turnaround;
+        word  _gapPeak;                  // longest silence lately, us
+        byte  _gapFrames;                // good frames since learning started
+        bool  _adapt;                    // MB_CONFIG_TIMING at the last calibrate()
+        void calibrate();
+        #endif
+        void closeFrame();
+        void startTx(word len, bool addCrc);
+        void setBaud(long baud);
+        void switchBaud(long baud);
+        void baudRequest();
+        #else
+        byte  _rxState;
+        bool  _rxError;        // frame broken by a t1.5 gap or too long
+        word  _rxCrc;          // CRC of the frame so far
+        word  _rxLen;
+        unsigned long _rxLast; // micros() when the last byte was read
+        void polledFrameReady();
+        void endTx();
+        #endif
         word calcCrc(byte address, byte* pduframe, byte pdulen);
+        void frameReady();
+        void setTimeouts(long baud);
+        bool isGroup(byte address);
     public:
         ModbusSerial();
         bool setSlaveId(byte slaveId);
         byte getSlaveId();
+        bool addGroup(byte groupId);
+        void diagnostics(word firstReg, word configReg);
         void task();
         bool receive(byte* frame);
         bool sendPDU(byte* pduframe);
         bool send(byte* frame);
 
+        #ifdef USE_USART_ISR
+        bool config(long baud, int txPin=-1);
+        void usartRx();  // called from the USART interrupts
+        void usartUdre();
+        void usartTxc();
+        #else
         bool config(HardwareSerial* port, long baud, int txPin);
+        #endif
 
         #ifdef DEBUG_MODE
         bool config(HardwareSerial* port, HardwareSerial* DebugSerialPort, long baud, int txPin=-1);
@@ -58,46 +252,4 @@ class ModbusSerial : public Modbus {
         #endif
 };
 
-/* Table of CRC values for high�order byte */
-const byte _auchCRCHi[] = {
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81,
-	0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-	0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01,
-	0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41,
-	0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81,
-	0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-	0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01,
-	0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
-	0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81,
-	0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-	0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01,
-	0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-	0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81,
-	0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-	0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01,
-	0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-	0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81,
-	0x40};
-
-/* Table of CRC values for low�order byte */
-const byte _auchCRCLo[] = {
-    0x00, 0xC0, 0xC1, 0x01, 0xC3, 0x03, 0x02, 0xC2, 0xC6, 0x06, 0x07, 0xC7, 0x05, 0xC5, 0xC4,
-	0x04, 0xCC, 0x0C, 0x0D, 0xCD, 0x0F, 0xCF, 0xCE, 0x0E, 0x0A, 0xCA, 0xCB, 0x0B, 0xC9, 0x09,
-	0x08, 0xC8, 0xD8, 0x18, 0x19, 0xD9, 0x1B, 0xDB, 0xDA, 0x1A, 0x1E, 0xDE, 0xDF, 0x1F, 0xDD,
-	0x1D, 0x1C, 0xDC, 0x14, 0xD4, 0xD5, 0x15, 0xD7, 0x17, 0x16, 0xD6, 0xD2, 0x12, 0x13, 0xD3,
-	0x11, 0xD1, 0xD0, 0x10, 0xF0, 0x30, 0x31, 0xF1, 0x33, 0xF3, 0xF2, 0x32, 0x36, 0xF6, 0xF7,
-	0x37, 0xF5, 0x35, 0x34, 0xF4, 0x3C, 0xFC, 0xFD, 0x3D, 0xFF, 0x3F, 0x3E, 0xFE, 0xFA, 0x3A,
-	0x3B, 0xFB, 0x39, 0xF9, 0xF8, 0x38, 0x28, 0xE8, 0xE9, 0x29, 0xEB, 0x2B, 0x2A, 0xEA, 0xEE,
-	0x2E, 0x2F, 0xEF, 0x2D, 0xED, 0xEC, 0x2C, 0xE4, 0x24, 0x25, 0xE5, 0x27, 0xE7, 0xE6, 0x26,
-	0x22, 0xE2, 0xE3, 0x23, 0xE1, 0x21, 0x20, 0xE0, 0xA0, 0x60, 0x61, 0xA1, 0x63, 0xA3, 0xA2,
-	0x62, 0x66, 0xA6, 0xA7, 0x67, 0xA5, 0x65, 0x64, 0xA4, 0x6C, 0xAC, 0xAD, 0x6D, 0xAF, 0x6F,
-	0x6E, 0xAE, 0xAA, 0x6A, 0x6B, 0xAB, 0x69, 0xA9, 0xA8, 0x68, 0x78, 0xB8, 0xB9, 0x79, 0xBB,
-	0x7B, 0x7A, 0xBA, 0xBE, 0x7E, 0x7F, 0xBF, 0x7D, 0xBD, 0xBC, 0x7C, 0xB4, 0x74, 0x75, 0xB5,
-	0x77, 0xB7, 0xB6, 0x76, 0x72, 0xB2, 0xB3, 0x73, 0xB1, 0x71, 0x70, 0xB0, 0x50, 0x90, 0x91,
-	0x51, 0x93, 0x53, 0x52, 0x92, 0x96, 0x56, 0x57, 0x97, 0x55, 0x95, 0x94, 0x54, 0x9C, 0x5C,
-	0x5D, 0x9D, 0x5F, 0x9F, 0x9E, 0x5E, 0x5A, 0x9A, 0x9B, 0x5B, 0x99, 0x59, 0x58, 0x98, 0x88,
-	0x48, 0x49, 0x89, 0x4B, 0x8B, 0x8A, 0x4A, 0x4E, 0x8E, 0x8F, 0x4F, 0x8D, 0x4D, 0x4C, 0x8C,
-	0x44, 0x84, 0x85, 0x45, 0x87, 0x47, 0x46, 0x86, 0x82, 0x42, 0x43, 0x83, 0x41, 0x81, 0x80,
-	0x40};
-
 #endif //MODBUSSERIAL_H
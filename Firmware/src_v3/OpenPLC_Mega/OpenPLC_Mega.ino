@@ -40,14 +40,112 @@ Analog Out: 2, 3, 4, 5, 6, 7, 8, 9,               (%QW100 - %QW107)
 *********************************************************************/
 
 #include <Arduino.h>
+#include <EEPROM.h>
 #include "Modbus.h"
 #include "ModbusSerial.h"
+#include "AnalogScanner.h"
+#include "EdgeCapture.h"
+#include "PulseCounter.h"
+#include "PulseTrain.h"
+#include "PwmOutput.h"
+#include "Scheduler.h"
 
-//ModBus Port information
+//ModBus Port information. BAUD is the speed after reset, the master can
+//move the line up to 2 Mbaud at runtime with function 0x43 (see
+//MB_FC_SET_BAUD and MB_BAUD_MAX in ModbusSerial.h). How fast the board
+//keeps up depends on the interrupts in use, a speed it cannot take falls
+//back on its own.
 #define BAUD        115200
-#define ID          0
+#define ID          1
 #define TXPIN       -1
 
+//Slave IDs are 1-247, address 0 is the broadcast. Writes sent to
+//address 0 or to GROUP_ID are applied by every board addressed and never
+//answered, so one frame updates the outputs of many boards. 248-255 are
+//reserved by the spec and make good group addresses.
+//#define GROUP_ID    248
+
+//Boot count, the epoch of function 0x42 (see MB_FC_READ_CHANGES in
+//Modbus.h), so a master that missed a reset resyncs instead of trusting a
+//sequence from before it. It takes EPOCH_SLOTS words of EEPROM from
+//EPOCH_EEPROM_ADDR on (bytes 0-31), reserved for it: each boot writes the
+//slot after the newest one, so a cell is only written every EPOCH_SLOTS
+//boots: 1.6 million boots at the 100000 writes a cell is rated for.
+#define EPOCH_EEPROM_ADDR   0
+#define EPOCH_SLOTS         16
+
+//Drive the outputs from inside the write request, before the reply is
+//sent, instead of on the next loop() pass. Comment out to disable.
+#define APPLY_OUTPUTS_ON_WRITE
+
+//Analog inputs are scanned in the background by the ADC interrupt.
+//Prescaler sets the ADC clock, oversample the number of samples averaged
+//per channel (power of two, up to 64)
+#define ADC_PRESCALER   ADC_PRESCALER_128
+#define ADC_OVERSAMPLE  4
+
+//Analog inputs that move less than the deadband (in register units, 64
+//per ADC step) are not reported by the delta read function (0x42), so
+//noise does not keep them in every reply. Plain reads are not affected.
+#define AIN_DEADBAND    128
+
+//Discrete input edge capture. Bit n of a mask latches edges of input n
+//(bit 0 is %IX100.0) until the master reads it, so pulses shorter than the
+//scan are not lost. Debounce is in microseconds.
+//Only inputs on pins with a pin change or external interrupt can be
+//captured: 50, 52, 14, 15 (PCINT) and 18, 19, 20, 21 (INT3-INT0), that is
+//%IX101.6, %IX101.7, %IX102.0, %IX102.1 and %IX102.4 - %IX102.7
+#define DIN_LATCH_RISING    0x00000000UL
+#define DIN_LATCH_FALLING   0x00000000UL
+#define DIN_DEBOUNCE_US     500
+
+//High speed counters on the external interrupt pins 21, 20, 19, 18 (INT0-INT3). The first
+//NUM_COUNTERS pins of pinMask_CNT count edges, each one adds COUNTER_REGS
+//input registers (count, period, frequency as 32 bit pairs) after the
+//analog inputs. A counter pin should not be latched by the edge capture.
+#define NUM_COUNTERS        0
+#define COUNTER_GATE_MS     100
+
+//Analog capture. The first NUM_CAPTURE pins of pinMask_CAP are sampled
+//every CAPTURE_DIVIDER Timer0 ticks into a FIFO of CAPTURE_DEPTH samples
+//(power of two, up to 32) each, scaled like the analog inputs. A tick is
+//1.024 ms, the rate is 976.5625 Hz / CAPTURE_DIVIDER, not 1 kHz. The
+//master drains FIFO n with FC24 (Read FIFO Queue) at address n. FC24 does
+//not take more than 31 samples, so a FIFO keeps at most 31 and counts the
+//samples it drops (see USE_FIFO_PARTIAL_READ in Modbus.h for deeper ones).
+//Each pin adds CAPTURE_IREGS input registers (samples queued, samples
+//lost) after the scan task times.
+#define NUM_CAPTURE         0
+#define CAPTURE_DIVIDER     1
+#define CAPTURE_DEPTH       32
+
+//Analog output PWM frequency. Outputs on 16 bit timer pins (2, 3, 5-8, 11
+//and 12) keep up to 16 bits of the holding register (all of them below
+//~245 Hz), the others 8. Pin 13 is on Timer0 and stays at 8 bits.
+#define PWM_FREQ_HZ         490
+
+//The I/O scan runs as separate tasks, loop() services Modbus between any
+//two of them. Each pass applies the outputs, then reads the inputs. After
+//every pass the scan is committed: the inputs read become the image the
+//master reads and the outputs written since become the image the next pass
+//applies, so neither a reply nor a pass mixes two scans. Periods are in
+//microseconds, 0 runs a task on every turn. The worst run time of each
+//task, in microseconds, is published in the input registers following the
+//pulse trains.
+#define DIN_PERIOD_US       0
+#define AIN_PERIOD_US       0
+#define CNT_PERIOD_US       1000
+#define DOUT_PERIOD_US      0
+#define AOUT_PERIOD_US      0
+#define PTO_PERIOD_US       0
+
+//Pulse train outputs, timed by Timer5. The first NUM_PULSE_OUTPUTS pins of
+//pinMask_PTO are driven by the timer instead of their coil or analog
+//output. Each one adds PT_HREGS holding registers (frequency, ramp, count,
+//control) after the analog outputs and PT_IREGS input registers (status,
+//frequency, pulses sent) after the counters.
+#define NUM_PULSE_OUTPUTS   0
+
 //Define the number of registers, inputs and coils to be created
 #define NUM_DISCRETE_INPUT      24
 #define NUM_INPUT_REGISTERS     16
@@ -59,10 +157,242 @@ uint8_t pinMask_DIN[] = {22, 24, 26, 28, 30, 32, 34, 36, 38, 40, 42, 44, 46, 48,
 uint8_t pinMask_AIN[] = {A0, A1, A2, A3, A4, A5, A6, A7, A8, A9, A10, A11, A12, A13, A14, A15};
 uint8_t pinMask_DOUT[] = {23, 25, 27, 29, 31, 33, 35, 37, 39, 41, 43, 45, 47, 49, 51, 53};
 uint8_t pinMask_AOUT[] = {2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13};
+uint8_t pinMask_CNT[] = {21, 20, 19, 18};
+uint8_t pinMask_CAP[] = {A0, A1};
+uint8_t pinMask_PTO[] = {51, 53};
 
 //Modbus Object
 ModbusSerial modbus;
 
+//Analog input scanner
+AnalogScanner analogScanner;
+
+//Discrete input edge capture
+EdgeCapture edgeCapture;
+
+//High speed counters
+PulseCounter pulseCounter;
+
+//Analog outputs
+PwmOutput pwmOutput;
+
+//I/O scan scheduler
+Scheduler scheduler;
+
+//Pulse train outputs
+PulseTrain pulseTrain;
+
+//Digital I/O is scanned a whole port at a time. Each port used by the pin
+//masks gets one entry holding its PINx/PORTx register and the bits that
+//belong to the mask, and each pin keeps the entry and bit it maps to.
+struct IOPort
+{
+    volatile uint8_t *reg;  //PINx for inputs, PORTx for outputs
+    uint8_t port;           //port number from digitalPinToPort()
+    uint8_t mask;           //bits of the port driven by the pin mask
+    uint8_t value;          //last sample or next output value
+    bool changed;           //output value not written to the port yet
+};
+
+IOPort inPorts[NUM_DISCRETE_INPUT];
+IOPort outPorts[NUM_COILS];
+uint8_t numInPorts = 0;
+uint8_t numOutPorts = 0;
+uint8_t portIndex_DIN[NUM_DISCRETE_INPUT];
+uint8_t portIndex_DOUT[NUM_COILS];
+uint8_t bitMask_DIN[NUM_DISCRETE_INPUT];
+uint8_t bitMask_DOUT[NUM_COILS];
+
+uint8_t mapPin(uint8_t pin, IOPort *ports, uint8_t &numPorts, bool output)
+{
+    uint8_t port = digitalPinToPort(pin);
+    uint8_t i;
+    for (i = 0; i < numPorts; i++)
+    {
+        if (ports[i].port == port) break;
+    }
+    
+    if (i == numPorts)
+    {
+        ports[i].reg = output ? portOutputRegister(port) : portInputRegister(port);
+        ports[i].port = port;
+        ports[i].mask = 0;
+        ports[i].value = 0;
+        numPorts++;
+    }
+    
+    ports[i].mask |= digitalPinToBitMask(pin);
+    return i;
+}
+
+bool isPulsePin(uint8_t pin)
+{
+    for (int i = 0; i < NUM_PULSE_OUTPUTS; i++)
+    {
+        if (pinMask_PTO[i] == pin) return true;
+    }
+    return false;
+}
+
+void configurePorts()
+{
+    for (int i = 0; i < NUM_DISCRETE_INPUT; i++)
+    {
+        portIndex_DIN[i] = mapPin(pinMask_DIN[i], inPorts, numInPorts, false);
+        bitMask_DIN[i] = digitalPinToBitMask(pinMask_DIN[i]);
+    }
+    
+    for (int i = 0; i < NUM_COILS; i++)
+    {
+        //Pulse train pins are left out of the port writes
+        if (isPulsePin(pinMask_DOUT[i]))
+        {
+            portIndex_DOUT[i] = 0;
+            bitMask_DOUT[i] = 0;
+            continue;
+        }
+        portIndex_DOUT[i] = mapPin(pinMask_DOUT[i], outPorts, numOutPorts, true);
+        bitMask_DOUT[i] = digitalPinToBitMask(pinMask_DOUT[i]);
+    }
+}
+
+void readDigitalInputs()
+{
+    //Sample every port once, the samples are split into inputs when the
+    //scan is committed
+    for (int p = 0; p < numInPorts; p++)
+    {
+        inPorts[p].value = *inPorts[p].reg;
+    }
+}
+
+void commitImage()
+{
+    //End of the pass. The discrete inputs are published here together with
+    //their latched edges, so the image the master reads next holds exactly
+    //the latches its read releases.
+    edgeCapture.scan();
+    for (int i = 0; i < NUM_DISCRETE_INPUT; ++i) 
+    {
+        modbus.Ists(i, edgeCapture.apply(i, inPorts[portIndex_DIN[i]].value & bitMask_DIN[i]));
+    }
+    
+    //Everything updated during the scan becomes visible to the master at once
+    modbus.commit();
+}
+
+void onModbusRead(byte table, word offset, word numregs)
+{
+    //Latched edges are released once the master has read them
+    if (table == MB_TABLE_ISTS)
+    {
+        edgeCapture.read(offset, numregs);
+    }
+}
+
+void writeDigitalOutputs()
+{
+    //Only the coils written since the last pass are applied
+    word offset = 0;
+    while (modbus.nextDirty(MB_TABLE_COILS, offset))
+    {
+        if (offset >= NUM_COILS) break;
+        if (bitMask_DOUT[offset])
+        {
+            IOPort *port = &outPorts[portIndex_DOUT[offset]];
+            if (modbus.Image(MB_TABLE_COILS, offset))
+                port->value |= bitMask_DOUT[offset];
+            else
+                port->value &= ~bitMask_DOUT[offset];
+            port->changed = true;
+        }
+        offset++;
+    }
+    
+    //All outputs of a port switch with one write. Interrupts are held off
+    //for the read-modify-write so ISRs driving other pins of the same port
+    //(e.g. the RS-485 enable) are not undone.
+    for (int p = 0; p < numOutPorts; p++)
+    {
+        if (!outPorts[p].changed) continue;
+        outPorts[p].changed = false;
+        
+        uint8_t sreg = SREG;
+        cli();
+        *outPorts[p].reg = (*outPorts[p].reg & ~outPorts[p].mask) | outPorts[p].value;
+        SREG = sreg;
+    }
+}
+
+void writeAnalogOutputs()
+{
+    //Only the holding registers written since the last pass are applied
+    word offset = 0;
+    while (modbus.nextDirty(MB_TABLE_HREGS, offset))
+    {
+        if (offset >= NUM_HOLDING_REGISTERS) break;
+        if (!isPulsePin(pinMask_AOUT[offset]))
+        {
+            pwmOutput.write(offset, modbus.Image(MB_TABLE_HREGS, offset));
+        }
+        offset++;
+    }
+}
+
+void onModbusWrite(byte table, word offset, word numregs)
+{
+    //Apply the outputs just written, only the changed ones are touched
+    modbus.commit(table);
+    if (table == MB_TABLE_COILS)
+    {
+        writeDigitalOutputs();
+    }
+    else if (table == MB_TABLE_HREGS)
+    {
+        writeAnalogOutputs();
+        pulseTrain.task();
+    }
+}
+
+void scanAnalogInputs()
+{
+    analogScanner.task();
+}
+
+void scanCounters()
+{
+    pulseCounter.task();
+}
+
+void runPulseTrains()
+{
+    pulseTrain.task();
+}
+
+word countBoot()
+{
+    //The slots hold consecutive counts, the newest is the one the next
+    //slot does not follow. Blank cells read 0xFFFF, so a blank EEPROM
+    //starts counting from slot 0.
+    int newest = EPOCH_SLOTS - 1;
+    word boots, next;
+    EEPROM.get(EPOCH_EEPROM_ADDR, boots);
+    for (int i = 0; i < EPOCH_SLOTS - 1; i++)
+    {
+        EEPROM.get(EPOCH_EEPROM_ADDR + (i + 1) * sizeof(word), next);
+        if (next != (word)(boots + 1))
+        {
+            newest = i;
+            break;
+        }
+        boots = next;
+    }
+    
+    boots++;
+    EEPROM.put(EPOCH_EEPROM_ADDR + (newest + 1) % EPOCH_SLOTS * sizeof(word), boots);
+    return boots;
+}
+
 void configurePins()
 {
     for (int i = 0; i < NUM_DISCRETE_INPUT; i++)
@@ -90,12 +420,24 @@ void setup()
 {
     //Setup board I/O
     configurePins();
+    configurePorts();
+    pwmOutput.begin(pinMask_AOUT, NUM_HOLDING_REGISTERS, PWM_FREQ_HZ);
     
     //Config Modbus Serial (port, speed, rs485 tx pin)
+    #ifdef USE_USART_ISR
+    modbus.config(BAUD, TXPIN);
+    #else
     modbus.config(&Serial, BAUD, TXPIN);
+    #endif
     
     //Set the Slave ID
     modbus.setSlaveId(ID); 
+    #ifdef GROUP_ID
+    modbus.addGroup(GROUP_ID);
+    #endif
+    
+    //Count the boot, every one gets its own epoch
+    modbus.setEpoch(countBoot());
     
     //Add all modbus registers
     for (int i = 0; i < NUM_DISCRETE_INPUT; ++i) 
@@ -114,28 +456,58 @@ void setup()
     {
         modbus.addHreg(i);
     }
+    
+    //Set up the analog input scan, it starts once every register exists
+    analogScanner.begin(&modbus, pinMask_AIN, NUM_INPUT_REGISTERS, 0, ADC_PRESCALER, ADC_OVERSAMPLE);
+    modbus.deadband(0, NUM_INPUT_REGISTERS, AIN_DEADBAND);
+    
+    //Start the discrete input edge capture
+    edgeCapture.begin(pinMask_DIN, NUM_DISCRETE_INPUT, DIN_LATCH_RISING, DIN_LATCH_FALLING, DIN_DEBOUNCE_US);
+    modbus.onRead(onModbusRead);
+    
+    //Start the high speed counters, their registers follow the analog inputs
+    pulseCounter.begin(&modbus, pinMask_CNT, NUM_COUNTERS, NUM_INPUT_REGISTERS, RISING, COUNTER_GATE_MS);
+    
+    //Start the pulse train outputs
+    pulseTrain.begin(&modbus, pinMask_PTO, NUM_PULSE_OUTPUTS, NUM_HOLDING_REGISTERS,
+                     NUM_INPUT_REGISTERS + NUM_COUNTERS * COUNTER_REGS);
+    
+    //Written outputs switch before the reply goes out
+    #ifdef APPLY_OUTPUTS_ON_WRITE
+    modbus.onWrite(onModbusWrite);
+    #endif
+    
+    //Split the I/O scan into tasks
+    scheduler.begin(&modbus, NUM_INPUT_REGISTERS + NUM_COUNTERS * COUNTER_REGS + NUM_PULSE_OUTPUTS * PT_IREGS);
+    scheduler.add(writeDigitalOutputs, DOUT_PERIOD_US);
+    scheduler.add(writeAnalogOutputs, AOUT_PERIOD_US);
+    scheduler.add(runPulseTrains, PTO_PERIOD_US);
+    scheduler.add(readDigitalInputs, DIN_PERIOD_US);
+    scheduler.add(scanAnalogInputs, AIN_PERIOD_US);
+    scheduler.add(scanCounters, CNT_PERIOD_US);
+    scheduler.onScan(commitImage);
+    
+    //Set up the analog capture, its registers follow the task times
+    analogScanner.capture(pinMask_CAP, NUM_CAPTURE, 0,
+                          NUM_INPUT_REGISTERS + NUM_COUNTERS * COUNTER_REGS + NUM_PULSE_OUTPUTS * PT_IREGS + scheduler.tasks(),
+                          CAPTURE_DIVIDER, CAPTURE_DEPTH);
+    
+    //Serial line timing (t1.5, t3.5, character gap, master turnaround in
+    //microseconds) and characters lost to overrun, its input registers
+    //follow the analog capture. The holding register after the pulse
+    //trains turns adaptive timing on (1) or off (0, the default), see
+    //MB_CONFIG_TIMING in ModbusSerial.h.
+    modbus.diagnostics(NUM_INPUT_REGISTERS + NUM_COUNTERS * COUNTER_REGS + NUM_PULSE_OUTPUTS * PT_IREGS + scheduler.tasks() +
+                       NUM_CAPTURE * CAPTURE_IREGS, NUM_HOLDING_REGISTERS + NUM_PULSE_OUTPUTS * PT_HREGS);
+    
+    //The ADC interrupt writes input registers, so it starts after the last
+    //register has been added
+    analogScanner.start();
 }
 
 void loop()
 {
-    //Run the main modbus task
+    //Service Modbus between every two slices of the I/O scan
     modbus.task();
-    
-    //Update modbus registers
-    for (int i = 0; i < NUM_DISCRETE_INPUT; ++i) 
-    {
-        modbus.Ists(i, digitalRead(pinMask_DIN[i]));
-    }
-    for (int i = 0; i < NUM_INPUT_REGISTERS; ++i) 
-    {
-        modbus.Ireg(i, (analogRead(pinMask_AIN[i]) * 64));
-    }
-    for (int i = 0; i < NUM_COILS; ++i) 
-    {
-        digitalWrite(pinMask_DOUT[i], modbus.Coil(i));
-    }
-    for (int i = 0; i < NUM_HOLDING_REGISTERS; ++i) 
-    {
-        analogWrite(pinMask_AOUT[i], (modbus.Hreg(i) / 256));
-    }
+    scheduler.run();
 }
\ No newline at end of file
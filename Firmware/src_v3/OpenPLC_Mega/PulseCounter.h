@@ -0,0 +1,56 @@
+/*
+    PulseCounter.h - High speed counter inputs for the OpenPLC firmware
+*/
+#include <Arduino.h>
+#include "Modbus.h"
+
+#ifndef PULSECOUNTER_H
+#define PULSECOUNTER_H
+
+//One counter per external interrupt pin (INT0/INT1 on the Uno, INT0-INT5
+//on the Mega)
+#if defined(__AVR_ATmega2560__)
+#define MAX_COUNTERS    6
+#else
+#define MAX_COUNTERS    2
+#endif
+
+//Input registers of each counter. Every value is 32 bits wide and takes a
+//pair of registers, high word first.
+enum {
+    COUNTER_REG_COUNT   = 0, // edges counted since power up, wraps around
+    COUNTER_REG_PERIOD  = 2, // mean period over the last gate, microseconds
+    COUNTER_REG_FREQ    = 4, // frequency over the last gate, milli-Hz
+    COUNTER_REGS        = 6,
+};
+
+//Each edge is counted and time stamped in the pin's interrupt. Once per
+//gate time task() turns the edges seen since the previous gate into a
+//period and a frequency, measured between the first and the last edge so
+//slow inputs keep their resolution. With no edge for the timeout both
+//read 0, and the first edges after that only start a new time base. The pairs are written from task() in one go, a reply never sees
+//half of an update.
+class PulseCounter {
+    private:
+        Modbus* _modbus;
+        uint8_t _count;
+        word _firstReg;
+        unsigned long _gate;
+        unsigned long _timeout;
+        unsigned long _lastGate;
+        uint32_t _prevEdges[MAX_COUNTERS];
+        unsigned long _prevTime[MAX_COUNTERS];
+        bool _running[MAX_COUNTERS];    // _prevTime is an edge of this run
+        uint32_t _period[MAX_COUNTERS];
+        uint32_t _freq[MAX_COUNTERS];
+
+        void publish(word reg, uint32_t value);
+
+    public:
+        PulseCounter();
+        void begin(Modbus* modbus, const uint8_t* pins, uint8_t count, word firstReg,
+                   int mode = RISING, word gateMs = 100, word timeoutMs = 2000);
+        void task();
+};
+
+#endif //PULSECOUNTER_H
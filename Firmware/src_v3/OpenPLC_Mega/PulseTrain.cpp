@@ -0,0 +1,231 @@
+/*
+    PulseTrain.cpp - Timer driven pulse train outputs for the OpenPLC firmware
+*/
+#include "PulseTrain.h"
+
+#if defined(__AVR_ATmega2560__)
+static PulseTrain* _trainOwner = 0;
+
+ISR(TIMER5_COMPA_vect) {
+  _trainOwner->isr();
+}
+#endif
+
+//Frequency asked for, capped at the highest the tick can make
+static word clampFreq(word hz) {
+  return hz > PT_TICK_HZ / 2 ? PT_TICK_HZ / 2 : hz;
+}
+
+//Sets the frequency and divides out its half period. A shorter half
+//period takes effect at once, a longer one from the next edge.
+static void setFreq(TPulseChannel* c, word freq) {
+  c->freq = freq;
+  if (!freq) return;
+  c->div = 2 * freq;
+  c->half = (word)PT_TICK_HZ / c->div;
+  c->rem = (word)PT_TICK_HZ % c->div;
+  if (c->err >= c->div) c->err = 0;
+  if (c->count > c->half) c->count = c->half;
+}
+
+//Moves the frequency one ramp step towards the target, or straight to it
+//without a ramp. Returns true once a braking train has come to a stop.
+static bool rampStep(TPulseChannel* c) {
+  word freq = c->freq;
+  word target = c->target;
+  if (c->braking) target = freq < c->base ? freq : c->base;
+  if (freq == target) {
+    if (!c->braking || c->total) return false;
+    c->state = PT_DONE;
+    *c->port &= ~c->mask;
+    return true;
+  }
+
+  word step = 0xFFFF;
+  if (c->ramped) {
+    step = c->step;
+    c->rampAcc += c->stepRem;
+    if (c->rampAcc >= PT_RAMP_HZ) {
+      c->rampAcc -= PT_RAMP_HZ;
+      step++;
+    }
+  }
+  if (freq < target) freq = (target - freq > step) ? freq + step : target;
+  else freq = (freq - target > step) ? freq - step : target;
+  setFreq(c, freq);
+  return false;
+}
+
+//Ramps a running train down to a stop, or stops it at once without a
+//ramp. Runs with interrupts off.
+static void stopTrain(TPulseChannel* c) {
+  c->total = 0;
+  if (c->ramped) {
+    c->braking = true;
+  } else {
+    c->state = PT_DONE;
+    *c->port &= ~c->mask;
+  }
+}
+
+PulseTrain::PulseTrain() {
+  _modbus = 0;
+  _count = 0;
+  _rampTick = 0;
+}
+
+void PulseTrain::begin(Modbus* modbus, const uint8_t* pins, uint8_t count, word firstHreg, word firstIreg) {
+  #if defined(__AVR_ATmega2560__)
+    _modbus = modbus;
+    _count = count > MAX_PULSE_OUTPUTS ? MAX_PULSE_OUTPUTS : count;
+    _firstHreg = firstHreg;
+    _firstIreg = firstIreg;
+    if (!_count) return;
+
+    for (uint8_t n = 0; n < _count; n++) {
+      TPulseChannel* c = &_ch[n];
+      for (uint8_t r = 0; r < PT_HREGS; r++) _modbus->addHreg(_firstHreg + n * PT_HREGS + r);
+      for (uint8_t r = 0; r < PT_IREGS; r++) _modbus->addIreg(_firstIreg + n * PT_IREGS + r);
+
+      pinMode(pins[n], OUTPUT);
+      digitalWrite(pins[n], LOW);
+      c->port = portOutputRegister(digitalPinToPort(pins[n]));
+      c->mask = digitalPinToBitMask(pins[n]);
+      c->state = PT_IDLE;
+      c->sent = 0;
+      c->control = 0;
+    }
+
+    //Timer5 in CTC mode, clk/8, compare A every tick
+    _trainOwner = this;
+    TCCR5A = 0;
+    TCCR5B = (1 << WGM52) | (1 << CS51);
+    OCR5A = F_CPU / 8 / PT_TICK_HZ - 1;
+    TCNT5 = 0;
+    TIMSK5 |= (1 << OCIE5A);
+  #else
+    (void)modbus;
+    (void)pins;
+    (void)count;
+    (void)firstHreg;
+    (void)firstIreg;
+  #endif
+}
+
+void PulseTrain::start(TPulseChannel* c, word hreg) {
+  //The registers come from the committed image, so both count halves and
+  //the frequency belong to the same scan
+  uint32_t total = (uint32_t)_modbus->Image(MB_TABLE_HREGS, hreg + PT_HREG_COUNT) << 16 |
+                   _modbus->Image(MB_TABLE_HREGS, hreg + PT_HREG_COUNT + 1);
+  word ramp = _modbus->Image(MB_TABLE_HREGS, hreg + PT_HREG_RAMP);
+  word target = clampFreq(_modbus->Image(MB_TABLE_HREGS, hreg + PT_HREG_FREQ));
+  word step = ramp / PT_RAMP_HZ;
+
+  MB_ATOMIC_BEGIN
+  //Nothing to send at 0 Hz, the train is done before it starts
+  if (!target) {
+    c->sent = 0;
+    c->state = PT_DONE;
+    MB_ATOMIC_END
+    return;
+  }
+  c->target = target;
+  c->ramped = ramp != 0;
+  c->step = step;
+  c->stepRem = ramp % PT_RAMP_HZ;
+  c->base = step ? step : 1;
+  c->rampAcc = 0;
+  c->high = false;
+  c->count = 1;
+  c->err = 0;
+  setFreq(c, c->ramped && c->base < target ? c->base : target);
+  c->rampPulses = 0;
+  c->total = total;
+  c->sent = 0;
+  c->braking = false;
+  c->state = PT_RUNNING;
+  MB_ATOMIC_END
+}
+
+void PulseTrain::publish(word reg, uint32_t value) {
+  _modbus->Ireg(reg, value >> 16);
+  _modbus->Ireg(reg + 1, value & 0xFFFF);
+}
+
+void PulseTrain::task() {
+  for (uint8_t n = 0; n < _count; n++) {
+    TPulseChannel* c = &_ch[n];
+    word hreg = _firstHreg + n * PT_HREGS;
+    word ireg = _firstIreg + n * PT_IREGS;
+    word control = _modbus->Image(MB_TABLE_HREGS, hreg + PT_HREG_CONTROL);
+
+    if (control != c->control) {
+      c->control = control;
+      if (control && c->state == PT_IDLE) {
+        this->start(c, hreg);
+      } else if (!control && c->state == PT_RUNNING) {
+        MB_ATOMIC_BEGIN
+        stopTrain(c);
+        MB_ATOMIC_END
+      }
+    }
+    if (!control && c->state == PT_DONE) c->state = PT_IDLE;
+
+    //Frequency and ramp may be changed while running, 0 Hz stops the
+    //train as control 0 does
+    if (c->state == PT_RUNNING) {
+      word target = clampFreq(_modbus->Image(MB_TABLE_HREGS, hreg + PT_HREG_FREQ));
+      MB_ATOMIC_BEGIN
+      c->target = target;
+      if (!target) stopTrain(c);
+      MB_ATOMIC_END
+    }
+
+    MB_ATOMIC_BEGIN
+    byte state = c->state;
+    word freq = c->freq;
+    uint32_t sent = c->sent;
+    MB_ATOMIC_END
+
+    _modbus->Ireg(ireg + PT_IREG_STATUS, state);
+    _modbus->Ireg(ireg + PT_IREG_FREQ, state == PT_RUNNING ? freq : 0);
+    this->publish(ireg + PT_IREG_SENT, sent);
+  }
+}
+
+void PulseTrain::isr() {
+  //Each output takes its ramp step on a tick of its own, so no tick does
+  //more than one division
+  uint8_t rampTick = _rampTick;
+  if (++_rampTick >= PT_TICK_HZ / PT_RAMP_HZ) _rampTick = 0;
+
+  for (uint8_t n = 0; n < _count; n++) {
+    TPulseChannel* c = &_ch[n];
+    if (c->state != PT_RUNNING) continue;
+    if (n == rampTick && rampStep(c)) continue;
+    if (!c->freq || --c->count) continue;
+
+    c->count = c->half;
+    c->err += c->rem;
+    if (c->err >= c->div) {
+      c->err -= c->div;
+      c->count++;
+    }
+
+    c->high = !c->high;
+    if (c->high) {
+      *c->port |= c->mask;
+      continue;
+    }
+
+    //Falling edge, one more pulse out
+    *c->port &= ~c->mask;
+    c->sent++;
+    if (!c->braking && c->freq < c->target) c->rampPulses++;
+    if (c->total) {
+      uint32_t left = c->total - c->sent;
+      if (!left) c->state = PT_DONE;
+      else if (c->ramped && left <= c->rampPulses) c->braking = true;
+    }
+  }
+}
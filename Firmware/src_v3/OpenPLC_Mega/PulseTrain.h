@@ -0,0 +1,93 @@
+/*
+    PulseTrain.h - Timer driven pulse train outputs for the OpenPLC firmware
+*/
+#include <Arduino.h>
+#include "Modbus.h"
+
+#ifndef PULSETRAIN_H
+#define PULSETRAIN_H
+
+//Pulse trains run from Timer5, so they are only available on the Mega
+//(the Uno has no timer left that isn't driving a PWM output, and its
+//sketch does not carry these files)
+#define MAX_PULSE_OUTPUTS   4
+#define PT_TICK_HZ          20000L  // timer tick, highest output is half of it
+#define PT_RAMP_HZ          1000    // ramp steps per second
+
+//Holding registers of each output
+enum {
+    PT_HREG_FREQ        = 0, // target frequency, Hz, 0 stops the train
+    PT_HREG_RAMP        = 1, // acceleration and deceleration, Hz/s, 0 = none
+    PT_HREG_COUNT       = 2, // pulses to send, 32 bits high word first, 0 = no end
+    PT_HREG_CONTROL     = 4, // 1 starts the train, 0 stops it / acknowledges done
+    PT_HREGS            = 5,
+};
+
+//Input registers of each output
+enum {
+    PT_IREG_STATUS      = 0, // PT_IDLE, PT_RUNNING or PT_DONE
+    PT_IREG_FREQ        = 1, // current frequency, Hz
+    PT_IREG_SENT        = 2, // pulses sent, 32 bits high word first
+    PT_IREGS            = 4,
+};
+
+//Output states
+enum {
+    PT_IDLE     = 0x00,
+    PT_RUNNING  = 0x01,
+    PT_DONE     = 0x02,
+};
+
+//Every tick counts down a 16 bit tick count and toggles the pin when it
+//runs out, so each output gets its own frequency from the one timer. A
+//half period of PT_TICK_HZ / (2 * freq) ticks is rarely whole: the
+//remainder adds up in err and lengthens a half period by one tick each
+//time it overflows, which keeps the average frequency exact. The ramp
+//moves the frequency PT_RAMP_HZ times a second, and only then is the half
+//period divided out again. A counted train starts braking once the pulses
+//left are as many as it took to speed up, so it stops at the end of the
+//count.
+typedef struct TPulseChannel {
+    volatile uint8_t* port;
+    uint8_t mask;
+    volatile byte state;
+    volatile bool braking;
+    bool high;
+    bool ramped;
+    volatile word freq;         // current frequency, Hz
+    volatile word target;       // frequency asked for, Hz
+    word step;                  // whole Hz of a ramp step
+    word stepRem;               // ramp % PT_RAMP_HZ, Hz/s
+    word base;                  // frequency a ramp starts from and brakes to
+    word rampAcc;               // ramp remainder carried between steps
+    word count;                 // ticks left to the next edge
+    word half;                  // whole ticks of a half period
+    word rem;                   // PT_TICK_HZ % div
+    word div;                   // 2 * freq
+    word err;                   // remainder added up, in units of 1 / div tick
+    volatile uint32_t rampPulses;
+    volatile uint32_t total;
+    volatile uint32_t sent;
+    word control;
+} TPulseChannel;
+
+class PulseTrain {
+    private:
+        Modbus* _modbus;
+        uint8_t _count;
+        word _firstHreg;
+        word _firstIreg;
+        uint8_t _rampTick;
+        TPulseChannel _ch[MAX_PULSE_OUTPUTS];
+
+        void start(TPulseChannel* c, word hreg);
+        void publish(word reg, uint32_t value);
+
+    public:
+        PulseTrain();
+        void begin(Modbus* modbus, const uint8_t* pins, uint8_t count, word firstHreg, word firstIreg);
+        void task();
+        void isr();
+};
+
+#endif //PULSETRAIN_H
@@ -0,0 +1,68 @@
+/*
+    Scheduler.cpp - Cooperative scan scheduler for the OpenPLC firmware
+*/
+#include "Scheduler.h"
+
+Scheduler::Scheduler() {
+  _modbus = 0;
+  _count = 0;
+  _next = 0;
+  _scan = 0;
+}
+
+void Scheduler::begin(Modbus* modbus, word firstReg) {
+  _modbus = modbus;
+  _firstReg = firstReg;
+}
+
+bool Scheduler::add(TTaskFunc func, unsigned long periodUs) {
+  if (_count >= MAX_TASKS) return false;
+
+  TTask* t = &_tasks[_count];
+  t->func = func;
+  t->period = periodUs;
+  t->last = micros();
+  t->worst = 0;
+  if (_modbus) _modbus->addIreg(_firstReg + _count);
+  _count++;
+  return true;
+}
+
+void Scheduler::onScan(TTaskFunc func) {
+  _scan = func;
+}
+
+void Scheduler::run() {
+  unsigned long now = micros();
+
+  //_next == _count is the turn of the scan hook
+  for (uint8_t k = 0; k <= _count; k++) {
+    uint8_t i = _next;
+    if (++_next > _count) _next = 0;
+    if (i == _count) {
+      if (!_scan) continue;
+      _scan();
+      return;
+    }
+
+    TTask* t = &_tasks[i];
+    if (t->period && now - t->last < t->period) continue;
+    t->last = now;
+    t->func();
+
+    unsigned long took = micros() - now;
+    if (took > t->worst) {
+      t->worst = took > 0xFFFF ? 0xFFFF : took;
+      if (_modbus) _modbus->Ireg(_firstReg + i, t->worst);
+    }
+    return;
+  }
+}
+
+word Scheduler::worst(uint8_t task) {
+  return task < _count ? _tasks[task].worst : 0;
+}
+
+uint8_t Scheduler::tasks() {
+  return _count;
+}
@@ -0,0 +1,47 @@
+/*
+    Scheduler.h - Cooperative scan scheduler for the OpenPLC firmware
+*/
+#include <Arduino.h>
+#include "Modbus.h"
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#define MAX_TASKS   8
+
+typedef void (*TTaskFunc)();
+
+typedef struct TTask {
+    TTaskFunc func;
+    unsigned long period;   // microseconds between runs, 0 = every turn
+    unsigned long last;     // micros() of the last run
+    word worst;             // longest run seen, microseconds
+} TTask;
+
+//The I/O scan is split into short tasks. Every run() starts at most one
+//task that is due, taking turns, so loop() can service Modbus between any
+//two of them and a request never waits for a whole scan. The longest run
+//of each task is kept and published in an input register, one per task in
+//the order they were added. The scan hook is not one of the tasks: it runs
+//on its own turn after every pass over them, due or not, so whatever it
+//commits always comes from one whole pass.
+class Scheduler {
+    private:
+        Modbus* _modbus;
+        word _firstReg;
+        TTask _tasks[MAX_TASKS];
+        uint8_t _count;
+        uint8_t _next;
+        TTaskFunc _scan;
+
+    public:
+        Scheduler();
+        void begin(Modbus* modbus, word firstReg);
+        bool add(TTaskFunc func, unsigned long periodUs = 0);
+        void onScan(TTaskFunc func);
+        void run();
+        word worst(uint8_t task);
+        uint8_t tasks();
+};
+
+#endif //SCHEDULER_H
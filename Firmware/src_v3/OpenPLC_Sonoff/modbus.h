@@ -35,6 +35,8 @@
 #define MB_FC_WRITE_REGISTER				6
 #define MB_FC_WRITE_MULTIPLE_COILS			15
 #define MB_FC_WRITE_MULTIPLE_REGISTERS		16
+#define MB_FC_MASK_WRITE_REGISTER			22
+#define MB_FC_READ_WRITE_MULTIPLE_REGISTERS	23
 #define MB_FC_ERROR							255
 
 #define ERR_NONE							0
@@ -507,6 +509,101 @@ void WriteMultipleRegisters(unsigned char *buffer, int bufferSize)
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Implementation of Modbus/TCP Mask Write Register
+//-----------------------------------------------------------------------------
+void MaskWriteRegister(unsigned char *buffer, int bufferSize)
+{
+	int Start;
+	uint16_t AndMask, OrMask;
+
+	//this request must have at least 14 bytes. If it doesn't, it's a corrupted message
+	if (bufferSize < 14)
+	{
+		ModbusError(buffer, ERR_ILLEGAL_DATA_VALUE);
+		return;
+	}
+
+	Start = create_word(buffer[8], buffer[9]);
+	AndMask = create_word(buffer[10], buffer[11]);
+	OrMask = create_word(buffer[12], buffer[13]);
+
+	if (Start >= MAX_HOLD_REGS) //invalid address
+	{
+		ModbusError(buffer, ERR_ILLEGAL_DATA_ADDRESS);
+		return;
+	}
+
+	//Result = (Current AND And_Mask) OR (Or_Mask AND (NOT And_Mask))
+	mb_holding_regs[Start] = (mb_holding_regs[Start] & AndMask) | (OrMask & ~AndMask);
+
+	//the response is an echo of the request
+	buffer[4] = 0;
+	buffer[5] = 8; //Number of bytes after this one.
+	MessageLength = 14;
+}
+
+//-----------------------------------------------------------------------------
+// Implementation of Modbus/TCP Read/Write Multiple Registers. The write is
+// applied before the read.
+//-----------------------------------------------------------------------------
+void ReadWriteMultipleRegisters(unsigned char *buffer, int bufferSize)
+{
+	int ReadStart, ReadLength, WriteStart, WriteLength, ByteDataLength;
+
+	//this request must have at least 17 bytes. If it doesn't, it's a corrupted message
+	if (bufferSize < 17)
+	{
+		ModbusError(buffer, ERR_ILLEGAL_DATA_VALUE);
+		return;
+	}
+
+	ReadStart = create_word(buffer[8], buffer[9]);
+	ReadLength = create_word(buffer[10], buffer[11]);
+	WriteStart = create_word(buffer[12], buffer[13]);
+	WriteLength = create_word(buffer[14], buffer[15]);
+	ByteDataLength = ReadLength * 2;
+
+	//the spec allows 1 to 125 registers read and 1 to 121 written
+	if ( (ReadLength < 1) || (ReadLength > 125) || (WriteLength < 1) || (WriteLength > 121) )
+	{
+		ModbusError(buffer, ERR_ILLEGAL_DATA_VALUE);
+		return;
+	}
+
+	//this request must have all the bytes it wants to write. If it doesn't, it's a corrupted message
+	if ( (bufferSize < (17 + WriteLength * 2)) || (buffer[16] != WriteLength * 2) )
+	{
+		ModbusError(buffer, ERR_ILLEGAL_DATA_VALUE);
+		return;
+	}
+
+	//both ranges are checked before anything is written
+	if ( (ReadStart + ReadLength > MAX_HOLD_REGS) || (WriteStart + WriteLength > MAX_HOLD_REGS) )
+	{
+		ModbusError(buffer, ERR_ILLEGAL_DATA_ADDRESS);
+		return;
+	}
+
+	for(int i = 0; i < WriteLength; i++)
+	{
+		mb_holding_regs[WriteStart + i] = create_word(buffer[17 + i * 2], buffer[18 + i * 2]);
+	}
+
+	//preparing response
+	buffer[4] = highByte(ByteDataLength + 3);
+	buffer[5] = lowByte(ByteDataLength + 3); //Number of bytes after this one
+	buffer[8] = ByteDataLength;     //Number of bytes of data
+
+	for(int i = 0; i < ReadLength; i++)
+	{
+		buffer[ 9 + i * 2] = highByte(mb_holding_regs[ReadStart + i]);
+		buffer[10 + i * 2] = lowByte(mb_holding_regs[ReadStart + i]);
+	}
+
+	MessageLength = ByteDataLength + 9;
+}
+
 //-----------------------------------------------------------------------------
 // This function must parse and process the client request and write back the
 // response for it. The return value is the size of the response message in
@@ -570,6 +667,18 @@ int processModbusMessage(unsigned char *buffer, int bufferSize)
 		WriteMultipleRegisters(buffer, bufferSize);
 	}
 
+	//****************** Mask Write Register ******************
+	else if(buffer[7] == MB_FC_MASK_WRITE_REGISTER)
+	{
+		MaskWriteRegister(buffer, bufferSize);
+	}
+
+	//****************** Read/Write Multiple Registers ******************
+	else if(buffer[7] == MB_FC_READ_WRITE_MULTIPLE_REGISTERS)
+	{
+		ReadWriteMultipleRegisters(buffer, bufferSize);
+	}
+
 	//****************** Function Code Error ******************
 	else
 	{
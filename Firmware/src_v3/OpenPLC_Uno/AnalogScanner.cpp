@@ -0,0 +1,214 @@
+/*
+    AnalogScanner.cpp - Background ADC scan for the OpenPLC firmware
+*/
+#include "AnalogScanner.h"
+
+#ifdef USE_ADC_ISR
+static AnalogScanner* _adcOwner = 0;
+
+ISR(ADC_vect) {
+  _adcOwner->isr();
+}
+#endif
+
+#ifdef USE_CAPTURE_ISR
+ISR(TIMER0_COMPA_vect) {
+  _adcOwner->trigger();
+}
+#endif
+
+AnalogScanner::AnalogScanner() {
+  _modbus = 0;
+  _count = 0;
+  _capCount = 0;
+  _capDue = false;
+  _capPos = 0;
+}
+
+void AnalogScanner::begin(Modbus* modbus, const uint8_t* pins, uint8_t count, word firstReg, byte prescaler, byte oversample) {
+  _modbus = modbus;
+  _pins = pins;
+  _count = count;
+  _firstReg = firstReg;
+  _channel = 0;
+  _sample = 0;
+  _sum = 0;
+
+  //oversample is rounded down to a power of two, at most 64 so the sum
+  //of 10 bit samples still fits a word
+  _shift = 0;
+  while (_shift < 6 && (2 << _shift) <= oversample) _shift++;
+  _prescaler = prescaler & 0x07;
+}
+
+//Must follow begin() and precede start(). Adds a FIFO of "depth" samples (power of two, up to
+//MB_FIFO_MAX_LEN) per pin at FC24 addresses fifoAddr on, and CAPTURE_IREGS input
+//registers per pin from firstReg on. Samples are taken every "divider"
+//Timer0 ticks.
+bool AnalogScanner::capture(const uint8_t* pins, uint8_t count, word fifoAddr, word firstReg, byte divider, byte depth) {
+  if (!_modbus || !count) return false;
+
+  byte size = 1;
+  while (size < MB_FIFO_MAX_LEN && (size << 1) <= depth) size <<= 1;
+
+  _fifos = (TRegFifo*) calloc(count, sizeof(TRegFifo));
+  if (!_fifos) return false;
+
+  for (uint8_t i = 0; i < count; i++) {
+    _fifos[i].data = (word*) calloc(size, sizeof(word));
+    if (!_fifos[i].data) return false;
+    _fifos[i].mask = size - 1;
+    if (!_modbus->addFifo(fifoAddr + i, &_fifos[i])) return false;
+    _modbus->addIreg(firstReg + i * CAPTURE_IREGS + CAPTURE_REG_QUEUED);
+    _modbus->addIreg(firstReg + i * CAPTURE_IREGS + CAPTURE_REG_OVERRUNS);
+  }
+
+  _capPins = pins;
+  _capReg = firstReg;
+  _divider = divider ? divider : 1;
+  _tick = 0;
+  _capLast = micros();
+  _capCount = count;
+  return true;
+}
+
+//Starts the scan and the capture trigger. The conversion complete
+//interrupt writes input registers, so this must come after every
+//register of the sketch has been added: adding one may move the bank.
+void AnalogScanner::start() {
+  #ifdef USE_ADC_ISR
+    _adcOwner = this;
+    ADCSRA = (1 << ADEN) | (1 << ADIE) | _prescaler;
+    if (_count) {
+      select(_pins[0]);
+      ADCSRA |= (1 << ADSC);
+    }
+
+    //Only the interrupt is enabled, OCR0A keeps its value as the PWM duty
+    //of its pin: the compare matches once per Timer0 cycle whatever it is
+    #ifdef USE_CAPTURE_ISR
+    if (_capCount) TIMSK0 |= (1 << OCIE0A);
+    #endif
+  #endif
+}
+
+void AnalogScanner::select(uint8_t pin) {
+  #ifdef __AVR__
+    uint8_t channel = pin;
+    if (channel >= A0) channel -= A0;
+    #if defined(MUX5)
+      ADCSRB = (ADCSRB & ~(1 << MUX5)) | (((channel >> 3) & 0x01) << MUX5);
+    #endif
+    ADMUX = (1 << REFS0) | (channel & 0x07);
+  #endif
+}
+
+void AnalogScanner::push(uint8_t i, word value) {
+  TRegFifo* fifo = &_fifos[i];
+  byte queued = fifo->head - fifo->tail;
+  if (queued > fifo->mask || queued >= MB_FIFO_MAX_LEN) {
+    fifo->overruns++;
+    return;
+  }
+  fifo->data[fifo->head & fifo->mask] = value;
+  fifo->head++;
+}
+
+void AnalogScanner::trigger() {
+  if (++_tick < _divider) return;
+  _tick = 0;
+  due();
+}
+
+//A capture is due, runs with interrupts off
+void AnalogScanner::due() {
+  //The previous capture is still waiting for the ADC
+  if (_capDue || _capPos) {
+    for (uint8_t i = 0; i < _capCount; i++) _fifos[i].overruns++;
+    return;
+  }
+
+  #ifdef USE_ADC_ISR
+    //Nothing to scan, the ADC is idle and the capture starts right away
+    if (!_count) {
+      _capPos = 1;
+      select(_capPins[0]);
+      ADCSRA |= (1 << ADSC);
+      return;
+    }
+  #endif
+  _capDue = true;
+}
+
+void AnalogScanner::isr() {
+  word value = 0;
+  #ifdef __AVR__
+    value = ADC;
+  #endif
+
+  if (_capPos) {
+    push(_capPos - 1, value << 6);
+    if (_capPos < _capCount) {
+      select(_capPins[_capPos]);
+      _capPos++;
+    } else {
+      _capPos = 0;
+      if (!_count) return;
+      select(_pins[_channel]);
+    }
+  } else {
+    _sum += value;
+    if (++_sample >> _shift) {
+      _modbus->Ireg(_firstReg + _channel, _sum << (6 - _shift));
+      _sample = 0;
+      _sum = 0;
+      if (++_channel >= _count) _channel = 0;
+      select(_pins[_channel]);
+    }
+    if (_capDue) {
+      _capDue = false;
+      _capPos = 1;
+      select(_capPins[0]);
+    }
+  }
+
+  #ifdef __AVR__
+    ADCSRA |= (1 << ADSC);
+  #endif
+}
+
+void AnalogScanner::task() {
+  //Without the ADC interrupt the scan falls back to analogRead(), one
+  //channel per call so a call stays short, and capture on micros()
+  #ifndef USE_ADC_ISR
+    if (_capCount && micros() - _capLast >= 1024UL * _divider) {
+      _capLast += 1024UL * _divider;
+      for (uint8_t i = 0; i < _capCount; i++)
+        push(i, analogRead(_capPins[i]) << 6);
+    }
+    if (_count) {
+      word sum = 0;
+      for (uint8_t s = 0; s < (1 << _shift); s++)
+        sum += analogRead(_pins[_channel]);
+      _modbus->Ireg(_firstReg + _channel, sum << (6 - _shift));
+      if (++_channel >= _count) _channel = 0;
+    }
+  #elif !defined(USE_CAPTURE_ISR)
+    //The interrupt still converts, only the trigger comes from micros()
+    if (_capCount && micros() - _capLast >= 1024UL * _divider) {
+      _capLast += 1024UL * _divider;
+      MB_ATOMIC_BEGIN
+      due();
+      MB_ATOMIC_END
+    }
+  #endif
+
+  for (uint8_t i = 0; i < _capCount; i++) {
+    MB_ATOMIC_BEGIN
+    word queued = (byte)(_fifos[i].head - _fifos[i].tail);
+    word overruns = _fifos[i].overruns;
+    MB_ATOMIC_END
+    _modbus->Ireg(_capReg + i * CAPTURE_IREGS + CAPTURE_REG_QUEUED, queued);
+    _modbus->Ireg(_capReg + i * CAPTURE_IREGS + CAPTURE_REG_OVERRUNS, overruns);
+  }
+}
@@ -0,0 +1,96 @@
+/*
+    AnalogScanner.h - Background ADC scan for the OpenPLC firmware
+*/
+#include <Arduino.h>
+#include "Modbus.h"
+
+#ifndef ANALOGSCANNER_H
+#define ANALOGSCANNER_H
+
+//Run the scan from the ADC conversion complete interrupt. Without it
+//task() reads one channel per call with analogRead() and ADC_vect is left
+//to the sketch. AVR only.
+#define USE_ADC_ISR
+
+//Trigger capture from the Timer0 compare A interrupt, which then belongs
+//to the library. Without it (the default) task() takes the capture ticks
+//from micros(), each sample late by up to one scan, and TIMER0_COMPA_vect
+//is left to the sketch. Needs USE_ADC_ISR.
+//#define USE_CAPTURE_ISR
+
+#ifndef __AVR__
+#undef USE_ADC_ISR
+#endif
+
+#ifndef USE_ADC_ISR
+#undef USE_CAPTURE_ISR
+#endif
+
+//ADC clock prescaler (ADPS bits). The ADC wants 50-200 kHz for full
+//resolution, 16 MHz / 128 = 125 kHz is what analogRead() uses. Faster
+//clocks trade a bit or two of accuracy for scan rate.
+enum {
+    ADC_PRESCALER_16  = 4, // 1 MHz, ~13 us per conversion
+    ADC_PRESCALER_32  = 5, // 500 kHz
+    ADC_PRESCALER_64  = 6, // 250 kHz
+    ADC_PRESCALER_128 = 7, // 125 kHz, ~104 us per conversion
+};
+
+//Registers published per capture channel
+enum {
+    CAPTURE_REG_QUEUED   = 0, // samples waiting in the FIFO
+    CAPTURE_REG_OVERRUNS = 1, // samples lost, FIFO full or trigger missed
+    CAPTURE_IREGS        = 2,
+};
+
+//With USE_ADC_ISR the ADC runs on its own: every conversion complete interrupt
+//stores the result, moves the mux to the next channel and starts the next
+//conversion, so the input registers are always fresh and loop() never
+//waits on analogRead(). Each channel is sampled "oversample" times in a
+//row (1, 2, 4 ... 64) and the average is published scaled by 64, like the
+//old analogRead() * 64.
+//Capture channels are sampled at a fixed rate into a FIFO each, read and
+//drained by the master with FC24. The rate is the Timer0 tick, Timer0
+//being the millis() timer that always runs at F_CPU / 64 / 256 (976.5625
+//Hz, 1.024 ms, at 16 MHz): the compare A interrupt with USE_CAPTURE_ISR,
+//micros() otherwise. The next conversion complete interrupt then converts
+//the capture channels back to back, one sample each, before the scan
+//resumes where it was.
+class AnalogScanner {
+    private:
+        Modbus* _modbus;
+        const uint8_t* _pins;
+        uint8_t _count;
+        word _firstReg;
+        uint8_t _shift;
+        byte _prescaler;
+        uint8_t _channel;
+        uint8_t _sample;
+        word _sum;
+        TRegFifo* _fifos;
+        const uint8_t* _capPins;
+        uint8_t _capCount;
+        word _capReg;
+        uint8_t _divider;
+        uint8_t _tick;
+        volatile bool _capDue;
+        volatile uint8_t _capPos;   // capture channel being converted + 1, 0 = scanning
+        unsigned long _capLast;
+
+        void select(uint8_t pin);
+        void push(uint8_t i, word value);
+        void due();
+
+    public:
+        AnalogScanner();
+        void begin(Modbus* modbus, const uint8_t* pins, uint8_t count, word firstReg = 0,
+                   byte prescaler = ADC_PRESCALER_128, byte oversample = 1);
+        bool capture(const uint8_t* pins, uint8_t count, word fifoAddr, word firstReg,
+                     byte divider = 1, byte depth = 32);
+        void start();
+        void task();
+        void isr();
+        void trigger();
+};
+
+#endif //ANALOGSCANNER_H
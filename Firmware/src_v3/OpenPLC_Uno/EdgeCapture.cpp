@@ -0,0 +1,161 @@
+/*
+    EdgeCapture.cpp - Latched edge capture for the OpenPLC discrete inputs
+*/
+#include "EdgeCapture.h"
+#include "ModbusSerial.h"
+
+static EdgeCapture* _captureOwner = 0;
+
+static void captureIsr() {
+  _captureOwner->isr();
+}
+
+#if !defined(__AVR__) || defined(USE_SOFTWARE_SERIAL)
+#undef USE_PIN_CHANGE
+#endif
+
+#ifdef USE_PIN_CHANGE
+
+#if defined(PCINT0_vect)
+ISR(PCINT0_vect) {
+  _captureOwner->isr();
+}
+#endif
+
+#if defined(PCINT1_vect)
+ISR(PCINT1_vect) {
+  _captureOwner->isr();
+}
+#endif
+
+#if defined(PCINT2_vect)
+ISR(PCINT2_vect) {
+  _captureOwner->isr();
+}
+#endif
+#endif
+
+static bool canCapture(uint8_t pin) {
+  #ifdef USE_PIN_CHANGE
+    if (digitalPinToPCICR(pin) != 0) return true;
+  #endif
+  return digitalPinToInterrupt(pin) != NOT_AN_INTERRUPT;
+}
+
+EdgeCapture::EdgeCapture() {
+  _count = 0;
+  _level = 0;
+  _rise = 0;
+  _fall = 0;
+  _shownRise = 0;
+  _shownFall = 0;
+}
+
+void EdgeCapture::begin(const uint8_t* pins, uint8_t count, uint32_t latchRising, uint32_t latchFalling,
+                        unsigned long debounceUs, word firstReg) {
+  _pins = pins;
+  _debounce = debounceUs;
+  _latchRising = latchRising;
+  _latchFalling = latchFalling;
+  _firstReg = firstReg;
+
+  //Only inputs that asked for a latch and have an interrupt are watched
+  if (count > 32) count = 32;
+  uint32_t wanted = latchRising | latchFalling;
+  uint8_t n = 0;
+  for (uint8_t i = 0; i < count; i++) {
+    if (bitRead(wanted, i) && canCapture(pins[i])) n++;
+  }
+  if (!n) return;
+
+  _input = (uint8_t*) calloc(n, sizeof(uint8_t));
+  _reg = (volatile uint8_t**) calloc(n, sizeof(volatile uint8_t*));
+  _mask = (uint8_t*) calloc(n, sizeof(uint8_t));
+  _edgeTime = (unsigned long*) calloc(n, sizeof(unsigned long));
+  if (!_input || !_reg || !_mask || !_edgeTime) return;
+
+  _captureOwner = this;
+  for (uint8_t i = 0; i < count; i++) {
+    uint8_t pin = pins[i];
+    if (!bitRead(wanted, i) || !canCapture(pin)) continue;
+
+    _input[_count] = i;
+    _reg[_count] = portInputRegister(digitalPinToPort(pin));
+    _mask[_count] = digitalPinToBitMask(pin);
+    if (*_reg[_count] & _mask[_count]) _level |= 1UL << i;
+    _count++;
+
+    #ifdef USE_PIN_CHANGE
+    if (digitalPinToPCICR(pin) != 0) {
+      *digitalPinToPCMSK(pin) |= bit(digitalPinToPCMSKbit(pin));
+      *digitalPinToPCICR(pin) |= bit(digitalPinToPCICRbit(pin));
+      continue;
+    }
+    #endif
+    attachInterrupt(digitalPinToInterrupt(pin), captureIsr, CHANGE);
+  }
+}
+
+//Must run with interrupts off
+void EdgeCapture::sample() {
+  unsigned long now = micros();
+  for (uint8_t k = 0; k < _count; k++) {
+    uint32_t bit = 1UL << _input[k];
+    bool level = (*_reg[k] & _mask[k]) != 0;
+    if (level == ((_level & bit) != 0)) continue;
+    if (now - _edgeTime[k] < _debounce) continue;
+
+    _edgeTime[k] = now;
+    if (level) {
+      _level |= bit;
+      _rise |= bit & _latchRising;
+    } else {
+      _level &= ~bit;
+      _fall |= bit & _latchFalling;
+    }
+  }
+}
+
+void EdgeCapture::isr() {
+  sample();
+}
+
+//Called once per scan before apply(). Picks up levels that settled while
+//an input was still in its debounce time and takes the latches to publish.
+void EdgeCapture::scan() {
+  if (!_count) return;
+
+  MB_ATOMIC_BEGIN
+  sample();
+  _shownRise = _rise;
+  _shownFall = _fall;
+  MB_ATOMIC_END
+}
+
+//Value to publish for an input whose current level is "level"
+bool EdgeCapture::apply(uint8_t input, bool level) {
+  if (input >= 32) return level;
+  uint32_t bit = 1UL << input;
+  if (!level && (_shownRise & bit)) return true;
+  if (level && (_shownFall & bit)) return false;
+  return level;
+}
+
+//The master has read the discrete inputs offset..offset + numregs - 1,
+//the latches it has seen are released. Edges latched after the last
+//scan() are kept for the next read.
+void EdgeCapture::read(word offset, word numregs) {
+  long lo = (long)offset - _firstReg;
+  long hi = lo + numregs;
+  if (lo < 0) lo = 0;
+  if (hi > 32) hi = 32;
+  if (lo >= hi) return;
+
+  uint32_t range = (hi - lo == 32) ? 0xFFFFFFFFUL : ((1UL << (hi - lo)) - 1) << lo;
+  MB_ATOMIC_BEGIN
+  _rise &= ~(range & _shownRise);
+  _fall &= ~(range & _shownFall);
+  MB_ATOMIC_END
+  _shownRise &= ~range;
+  _shownFall &= ~range;
+}
@@ -5,114 +5,412 @@
 #include "Modbus.h"
 
 Modbus::Modbus() {
-    _regs_head = 0;
-    _regs_last = 0;
+    for (byte t = 0; t < MB_TABLE_COUNT; t++) {
+        _banks[t].first = 0;
+        _banks[t].last  = 0;
+        _banks[t].data  = 0;
+        _banks[t].added = 0;
+        _banks[t].holes = 0;
+        _banks[t].dirty = 0;
+        _banks[t].image = 0;
+        _banks[t].stamp = 0;
+        _banks[t].ref   = 0;
+        _banks[t].seq   = 0;
+        _banks[t].aged  = 0;
+    }
+    _numDeadbands = 0;
+    _epoch = 0;
+    _onRead = 0;
+    _onWrite = 0;
+    _numFifos = 0;
+}
+
+//Must change whenever the slave restarts, see MB_FC_READ_CHANGES
+void Modbus::setEpoch(word epoch) {
+    _epoch = epoch;
+}
+
+void Modbus::onRead(TReadHook hook) {
+    _onRead = hook;
+}
+
+void Modbus::onWrite(TWriteHook hook) {
+    _onWrite = hook;
 }
 
-TRegister* Modbus::searchRegister(word address) {
-    TRegister *reg = _regs_head;
+bool Modbus::searchRegister(byte table, word offset, word numregs) {
+    TRegBank *bank = &_banks[table];
     //if there is no register configured, bail
-    if(reg == 0) return(0);
-    //scan through the linked list until the end of the list or the register is found.
-    //return the pointer.
-    do {
-        if (reg->address == address) return(reg);
-        reg = reg->next;
-	} while(reg);
-	return(0);
-}
-
-void Modbus::addReg(word address, word value) {
-    TRegister *newreg;
-
-	newreg = (TRegister *) malloc(sizeof(TRegister));
-	newreg->address = address;
-	newreg->value		= value;
-	newreg->next		= 0;
-
-	if(_regs_head == 0) {
-        _regs_head = newreg;
-        _regs_last = _regs_head;
+    if (bank->data == 0 || numregs == 0) return false;
+    //the whole range offset...offset + numregs - 1 must be inside the bank.
+    //Done in 32 bits so ranges touching offset 65535 do not wrap around.
+    if (offset < bank->first || (unsigned long)offset + numregs - 1 > bank->last)
+        return false;
+
+    //and, in a bank with holes, every one of them must have been added
+    if (!bank->holes) return true;
+    for (word i = offset - bank->first; numregs; i++, numregs--) {
+        if (!bitRead(bank->added[i / 8], i % 8)) return false;
+    }
+    return true;
+}
+
+unsigned long Modbus::bankSize(byte table) {
+    TRegBank *bank = &_banks[table];
+    if (bank->data == 0) return 0;
+    return (unsigned long)bank->last - bank->first + 1;
+}
+
+//Copies count registers of a bank into a larger one, shift places further
+static void moveRegs(byte *to, byte *from, bool bits, unsigned long shift, unsigned long count) {
+    for (unsigned long i = 0; i < count; i++) {
+        if (bits) {
+            if (bitRead(from[i / 8], i % 8))
+                bitSet(to[(i + shift) / 8], (i + shift) % 8);
+        } else {
+            ((word *)to)[i + shift] = ((word *)from)[i];
+        }
+    }
+}
+
+//Returns false if the bank could not grow to take the register
+bool Modbus::addReg(byte table, word offset, word value) {
+    TRegBank *bank = &_banks[table];
+    bool bits = (table == MB_TABLE_COILS || table == MB_TABLE_ISTS);
+    bool outputs = (table == MB_TABLE_COILS || table == MB_TABLE_HREGS);
+    word first = offset;
+    word last = offset;
+
+    if (bank->data) {
+        if (bank->first < first) first = bank->first;
+        if (bank->last > last) last = bank->last;
+    }
+
+    //Grow the bank so it covers first...last. This only happens while the
+    //sketch is adding its registers, so the copy cost doesn't matter.
+    if (!bank->data || first != bank->first || last != bank->last) {
+        unsigned long count = (unsigned long)last - first + 1;
+        unsigned long size = bits ? (count + 7) / 8 : count * sizeof(word);
+        //size_t is 16 bits on AVR, a block it cannot hold must not wrap
+        if ((bits && outputs ? size : count * sizeof(word)) > (size_t)-1)
+            return false;
+
+        byte *data  = (byte *) calloc(1, size);
+        byte *added = (byte *) calloc(1, (count + 7) / 8);
+        byte *image = (byte *) calloc(1, size);
+        byte *dirty = 0;
+        word *stamp = 0;
+        word *ref   = 0;
+        if (outputs) {
+            dirty = (byte *) calloc(1, (count + 7) / 8);
+        } else {
+            stamp = (word *) calloc(count, sizeof(word));
+            if (!bits) ref = (word *) calloc(count, sizeof(word));
+        }
+        if (!data || !added || !image || (outputs && !dirty) ||
+            (!outputs && (!stamp || (!bits && !ref)))) {
+            free(data);
+            free(added);
+            free(dirty);
+            free(image);
+            free(stamp);
+            free(ref);
+            return false;
+        }
+
+        //Registers added later count as changed by the last commit
+        if (stamp) {
+            for (unsigned long i = 0; i < count; i++)
+                stamp[i] = bank->seq;
+        }
+
+        //Every offset of the grown part is a hole until it is added
+        TRegBank old = *bank;
+        word holes = count;
+        if (old.data) {
+            unsigned long shift = old.first - first;
+            unsigned long oldcount = (unsigned long)old.last - old.first + 1;
+            moveRegs(data, old.data, bits, shift, oldcount);
+            moveRegs(added, old.added, true, shift, oldcount);
+            moveRegs(image, old.image, bits, shift, oldcount);
+            if (dirty) moveRegs(dirty, old.dirty, true, shift, oldcount);
+            if (stamp) moveRegs((byte *)stamp, (byte *)old.stamp, false, shift, oldcount);
+            if (ref) moveRegs((byte *)ref, (byte *)old.ref, false, shift, oldcount);
+            holes = old.holes + (count - oldcount);
+        }
+
+        //An interrupt may look the bank up at any time, it must never see
+        //the new range with the old arrays or the other way round
+        MB_ATOMIC_BEGIN
+        bank->first = first;
+        bank->last  = last;
+        bank->data  = data;
+        bank->added = added;
+        bank->holes = holes;
+        bank->dirty = dirty;
+        bank->image = image;
+        bank->stamp = stamp;
+        bank->ref   = ref;
+        MB_ATOMIC_END
+
+        free(old.data);
+        free(old.added);
+        free(old.dirty);
+        free(old.image);
+        free(old.stamp);
+        free(old.ref);
+    }
+
+    word i = offset - bank->first;
+    if (!bitRead(bank->added[i / 8], i % 8)) {
+        MB_ATOMIC_BEGIN
+        bitSet(bank->added[i / 8], i % 8);
+        bank->holes--;
+        MB_ATOMIC_END
+    }
+
+    this->Reg(table, offset, value);
+
+    //An output reaches the sketch with the value it was added with, and is
+    //dirty so it gets applied once
+    if (outputs) {
+        if (!bits) ((word *)bank->image)[i] = value;
+        else if (value) bitSet(bank->image[i / 8], i % 8);
+        else bitClear(bank->image[i / 8], i % 8);
+        bitSet(bank->dirty[i / 8], i % 8);
+    }
+    return true;
+}
+
+bool Modbus::Reg(byte table, word offset, word value) {
+    TRegBank *bank = &_banks[table];
+    if (!this->searchRegister(table, offset)) return false;
+
+    word i = offset - bank->first;
+    MB_ATOMIC_BEGIN
+    if (table == MB_TABLE_COILS || table == MB_TABLE_ISTS) {
+        if (value)
+            bitSet(bank->data[i / 8], i % 8);
+        else
+            bitClear(bank->data[i / 8], i % 8);
     } else {
-        //Assign the last register's next pointer to newreg.
-        _regs_last->next = newreg;
-        //then make temp the last register in the list.
-        _regs_last = newreg;
+        ((word *)bank->data)[i] = value;
     }
+    MB_ATOMIC_END
+    return true;
 }
 
-bool Modbus::Reg(word address, word value) {
-    TRegister *reg;
-    //search for the register address
-    reg = this->searchRegister(address);
-    //if found then assign the register value to the new value.
-    if (reg) {
-        reg->value = value;
-        return true;
-    } else
-        return false;
+word Modbus::Reg(byte table, word offset) {
+    TRegBank *bank = &_banks[table];
+    if (!this->searchRegister(table, offset)) return 0;
+
+    word i = offset - bank->first;
+    if (table == MB_TABLE_COILS || table == MB_TABLE_ISTS)
+        return bitRead(bank->data[i / 8], i % 8);
+
+    MB_ATOMIC_BEGIN
+    word value = ((word *)bank->data)[i];
+    MB_ATOMIC_END
+    return value;
 }
 
-word Modbus::Reg(word address) {
-    TRegister *reg;
-    reg = this->searchRegister(address);
-    if(reg)
-        return(reg->value);
+//Value from the last commit(): an input as the master sees it, an output
+//as the sketch applies it
+word Modbus::Image(byte table, word offset) {
+    TRegBank *bank = &_banks[table];
+    if (!this->searchRegister(table, offset)) return 0;
+
+    word i = offset - bank->first;
+    if (table == MB_TABLE_COILS || table == MB_TABLE_ISTS)
+        return bitRead(bank->image[i / 8], i % 8);
     else
-        return(0);
+        return ((word *)bank->image)[i];
 }
 
-void Modbus::addHreg(word offset, word value) {
-    this->addReg(offset + 40001, value);
+//Scan boundary, commits every table
+void Modbus::commit() {
+    for (byte t = 0; t < MB_TABLE_COUNT; t++) this->commit(t);
+}
+
+//The inputs updated since the last commit become visible to the master
+//together. Interrupts are only held off for each single copy, the ISRs
+//just write single registers so that is enough to not tear them.
+//Registers that changed are stamped with the next sequence number of
+//their table, 0 is skipped as it asks MB_FC_READ_CHANGES for everything.
+//The outputs written by the master since the last commit reach the sketch
+//together, those that changed are marked dirty for nextDirty(). Only
+//requests write them, so they need no interrupt lock.
+void Modbus::commit(byte t) {
+    TRegBank *bank = &_banks[t];
+    if (!bank->image) return;
+
+    if (t == MB_TABLE_COILS || t == MB_TABLE_HREGS) {
+        unsigned long count = this->bankSize(t);
+        if (t == MB_TABLE_COILS) {
+            for (unsigned long i = 0; i < (count + 7) / 8; i++) {
+                bank->dirty[i] |= bank->data[i] ^ bank->image[i];
+                bank->image[i] = bank->data[i];
+            }
+        } else {
+            for (unsigned long i = 0; i < count; i++) {
+                word value = ((word *)bank->data)[i];
+                if (value == ((word *)bank->image)[i]) continue;
+                ((word *)bank->image)[i] = value;
+                bitSet(bank->dirty[i / 8], i % 8);
+            }
+        }
+        return;
+    }
+
+    word seq = bank->seq + 1;
+    if (!seq) seq = 1;
+    bool changed = false;
+
+    unsigned long count = this->bankSize(t);
+    if (t == MB_TABLE_ISTS) {
+        for (unsigned long i = 0; i < (count + 7) / 8; i++) {
+            MB_ATOMIC_BEGIN
+            byte value = bank->data[i];
+            MB_ATOMIC_END
+            byte diff = value ^ bank->image[i];
+            bank->image[i] = value;
+            for (byte b = 0; diff; b++, diff >>= 1) {
+                if (diff & 0x01) {
+                    bank->stamp[i * 8 + b] = seq;
+                    changed = true;
+                }
+            }
+        }
+    } else {
+        for (unsigned long i = 0; i < count; i++) {
+            MB_ATOMIC_BEGIN
+            word value = ((word *)bank->data)[i];
+            MB_ATOMIC_END
+            ((word *)bank->image)[i] = value;
+
+            word offset = bank->first + i;
+            word band = 0;
+            for (byte d = 0; d < _numDeadbands; d++) {
+                if (offset >= _deadFirst[d] && offset <= _deadLast[d]) {
+                    band = _deadband[d];
+                    break;
+                }
+            }
+            word ref = bank->ref[i];
+            if ((value > ref ? value - ref : ref - value) > band) {
+                bank->ref[i] = value;
+                bank->stamp[i] = seq;
+                changed = true;
+            }
+        }
+    }
+
+    if (changed) {
+        bank->seq = seq;
+        //Stamps are compared modulo 2^16. Each change checks one more
+        //register and moves its stamp up to half the range behind, so
+        //no stamp ever gets old enough to look recent again.
+        if (bank->aged >= count) bank->aged = 0;
+        if ((word)(seq - bank->stamp[bank->aged]) >= 0x8000)
+            bank->stamp[bank->aged] = seq - 0x8000;
+        bank->aged++;
+    }
+}
+
+//Input registers offset...offset + numregs - 1 only count as changed for
+//MB_FC_READ_CHANGES once they moved more than value from the value last
+//stamped. 32 bit pairs should be left out, their high word steps by one.
+//Up to MB_MAX_DEADBANDS ranges, one set again from the same offset is
+//replaced. Where ranges overlap the one set first applies.
+bool Modbus::deadband(word offset, word numregs, word value) {
+    if (!numregs) return false;
+
+    byte d = 0;
+    while (d < _numDeadbands && _deadFirst[d] != offset) d++;
+    if (d >= MB_MAX_DEADBANDS) return false;
+    if (d == _numDeadbands) _numDeadbands++;
+
+    _deadFirst[d] = offset;
+    _deadLast[d] = (unsigned long)offset + numregs - 1 > 0xFFFF ? 0xFFFF : offset + numregs - 1;
+    _deadband[d] = value;
+    return true;
+}
+
+//Finds the first changed register at or after offset, clears its dirty bit
+//and leaves its offset in offset. Call again from offset + 1 for the next.
+bool Modbus::nextDirty(byte table, word &offset) {
+    TRegBank *bank = &_banks[table];
+    if (!bank->dirty || offset > bank->last) return false;
+
+    unsigned long count = this->bankSize(table);
+    unsigned long i = offset < bank->first ? 0 : offset - bank->first;
+    while (i < count) {
+        byte b = bank->dirty[i / 8] >> (i % 8);
+        if (!b) {
+            //Nothing left in this byte, skip to the next one
+            i = (i / 8 + 1) * 8;
+            continue;
+        }
+        while (!(b & 0x01)) {
+            b >>= 1;
+            i++;
+        }
+        MB_ATOMIC_BEGIN
+        bitClear(bank->dirty[i / 8], i % 8);
+        MB_ATOMIC_END
+        offset = bank->first + i;
+        return true;
+    }
+    return false;
+}
+
+bool Modbus::addHreg(word offset, word value) {
+    return this->addReg(MB_TABLE_HREGS, offset, value);
 }
 
 bool Modbus::Hreg(word offset, word value) {
-    return Reg(offset + 40001, value);
+    return Reg(MB_TABLE_HREGS, offset, value);
 }
 
 word Modbus::Hreg(word offset) {
-    return Reg(offset + 40001);
+    return Reg(MB_TABLE_HREGS, offset);
 }
 
 #ifndef USE_HOLDING_REGISTERS_ONLY
-    void Modbus::addCoil(word offset, bool value) {
-        this->addReg(offset + 1, value?0xFF00:0x0000);
+    bool Modbus::addCoil(word offset, bool value) {
+        return this->addReg(MB_TABLE_COILS, offset, value);
     }
 
-    void Modbus::addIsts(word offset, bool value) {
-        this->addReg(offset + 10001, value?0xFF00:0x0000);
+    bool Modbus::addIsts(word offset, bool value) {
+        return this->addReg(MB_TABLE_ISTS, offset, value);
     }
 
-    void Modbus::addIreg(word offset, word value) {
-        this->addReg(offset + 30001, value);
+    bool Modbus::addIreg(word offset, word value) {
+        return this->addReg(MB_TABLE_IREGS, offset, value);
     }
 
     bool Modbus::Coil(word offset, bool value) {
-        return Reg(offset + 1, value?0xFF00:0x0000);
+        return Reg(MB_TABLE_COILS, offset, value);
     }
 
     bool Modbus::Ists(word offset, bool value) {
-        return Reg(offset + 10001, value?0xFF00:0x0000);
+        return Reg(MB_TABLE_ISTS, offset, value);
     }
 
     bool Modbus::Ireg(word offset, word value) {
-        return Reg(offset + 30001, value);
+        return Reg(MB_TABLE_IREGS, offset, value);
     }
 
     bool Modbus::Coil(word offset) {
-        if (Reg(offset + 1) == 0xFF00) {
-            return true;
-        } else return false;
+        return Reg(MB_TABLE_COILS, offset);
     }
 
     bool Modbus::Ists(word offset) {
-        if (Reg(offset + 10001) == 0xFF00) {
-            return true;
-        } else return false;
+        return Reg(MB_TABLE_ISTS, offset);
     }
 
     word Modbus::Ireg(word offset) {
-        return Reg(offset + 30001);
+        return Reg(MB_TABLE_IREGS, offset);
     }
 #endif
 
@@ -139,6 +437,21 @@ void Modbus::receivePDU(byte* frame) {
             this->writeMultipleRegisters(frame,field1, field2, frame[5]);
         break;
 
+        case MB_FC_MASK_WRITE_REG:
+            //field1 = reg, field2 = andmask, frame[5..6] = ormask
+            this->maskWriteRegister(field1, field2, (word)frame[5] << 8 | (word)frame[6]);
+        break;
+
+        case MB_FC_READ_WRITE_REGS:
+            //field1 = readreg, field2 = numread
+            this->readWriteRegisters(frame, field1, field2);
+        break;
+
+        case MB_FC_READ_FIFO_QUEUE:
+            //field1 = fifo address
+            this->readFifoQueue(field1);
+        break;
+
         #ifndef USE_HOLDING_REGISTERS_ONLY
         case MB_FC_READ_COILS:
             //field1 = startreg, field2 = numregs
@@ -165,6 +478,16 @@ void Modbus::receivePDU(byte* frame) {
             this->writeMultipleCoils(frame,field1, field2, frame[5]);
         break;
 
+        case MB_FC_EXCHANGE_IMAGE:
+            //field1 = numcoils, field2 = numregs
+            this->exchangeImage(frame, field1, field2);
+        break;
+
+        case MB_FC_READ_CHANGES:
+            //field1 = startreg, field2 = numregs
+            this->readChanges(frame, field1, field2);
+        break;
+
         #endif
         default:
             this->exceptionResponse(fcode, MB_EX_ILLEGAL_FUNCTION);
@@ -172,10 +495,8 @@ void Modbus::receivePDU(byte* frame) {
 }
 
 void Modbus::exceptionResponse(byte fcode, byte excode) {
-    //Clean frame buffer
-    free(_frame);
+    //Build the response in place over the request
     _len = 2;
-    _frame = (byte *) malloc(_len);
     _frame[0] = fcode + 0x80;
     _frame[1] = excode;
 
@@ -191,25 +512,22 @@ void Modbus::readRegisters(word startreg, word numregs) {
 
     //Check Address
     //*** See comments on readCoils method.
-    if (!this->searchRegister(startreg + 40001)) {
+    if (!this->searchRegister(MB_TABLE_HREGS, startreg)) {
         this->exceptionResponse(MB_FC_READ_REGS, MB_EX_ILLEGAL_ADDRESS);
         return;
     }
 
 
-    //Clean frame buffer
-    free(_frame);
-	_len = 0;
-
 	//calculate the query reply message length
 	//for each register queried add 2 bytes
-	_len = 2 + numregs * 2;
+	word len = 2 + numregs * 2;
 
-    _frame = (byte *) malloc(_len);
-    if (!_frame) {
+    //The reply is built in place over the request, it must fit the frame
+    if (len > MAX_PDU) {
         this->exceptionResponse(MB_FC_READ_REGS, MB_EX_SLAVE_FAILURE);
         return;
     }
+	_len = len;
 
     _frame[0] = MB_FC_READ_REGS;
     _frame[1] = _len - 2;   //byte count
@@ -226,6 +544,7 @@ void Modbus::readRegisters(word startreg, word numregs) {
         i++;
 	}
 
+    if (_onRead) _onRead(MB_TABLE_HREGS, startreg, i);
     _reply = MB_REPLY_NORMAL;
 }
 
@@ -243,33 +562,27 @@ void Modbus::writeSingleRegister(word reg, word value) {
         return;
     }
 
+    if (_onWrite) _onWrite(MB_TABLE_HREGS, reg, 1);
     _reply = MB_REPLY_ECHO;
 }
 
 void Modbus::writeMultipleRegisters(byte* frame,word startreg, word numoutputs, byte bytecount) {
     //Check value
-    if (numoutputs < 0x0001 || numoutputs > 0x007B || bytecount != 2 * numoutputs) {
+    if (numoutputs < 0x0001 || numoutputs > 0x007B || bytecount != 2 * numoutputs ||
+        _len < 6 + bytecount) {
         this->exceptionResponse(MB_FC_WRITE_REGS, MB_EX_ILLEGAL_VALUE);
         return;
     }
 
     //Check Address (startreg...startreg + numregs)
-    for (int k = 0; k < numoutputs; k++) {
-        if (!this->searchRegister(startreg + 40001 + k)) {
-            this->exceptionResponse(MB_FC_WRITE_REGS, MB_EX_ILLEGAL_ADDRESS);
-            return;
-        }
-    }
-
-    //Clean frame buffer
-    free(_frame);
-	_len = 5;
-    _frame = (byte *) malloc(_len);
-    if (!_frame) {
-        this->exceptionResponse(MB_FC_WRITE_REGS, MB_EX_SLAVE_FAILURE);
+    if (!this->searchRegister(MB_TABLE_HREGS, startreg, numoutputs)) {
+        this->exceptionResponse(MB_FC_WRITE_REGS, MB_EX_ILLEGAL_ADDRESS);
         return;
     }
 
+    //The reply echoes the first 5 bytes of the request, built in place.
+    //The values are read from frame before anything past them is touched.
+	_len = 5;
     _frame[0] = MB_FC_WRITE_REGS;
     _frame[1] = startreg >> 8;
     _frame[2] = startreg & 0x00FF;
@@ -284,6 +597,135 @@ void Modbus::writeMultipleRegisters(byte* frame,word startreg, word numoutputs,
         i++;
 	}
 
+    if (_onWrite) _onWrite(MB_TABLE_HREGS, startreg, i);
+    _reply = MB_REPLY_NORMAL;
+}
+
+void Modbus::maskWriteRegister(word reg, word andmask, word ormask) {
+    //Check value (request length)
+    if (_len != 7) {
+        this->exceptionResponse(MB_FC_MASK_WRITE_REG, MB_EX_ILLEGAL_VALUE);
+        return;
+    }
+
+    //Check Address
+    if (!this->searchRegister(MB_TABLE_HREGS, reg)) {
+        this->exceptionResponse(MB_FC_MASK_WRITE_REG, MB_EX_ILLEGAL_ADDRESS);
+        return;
+    }
+
+    //Result = (Current AND And_Mask) OR (Or_Mask AND (NOT And_Mask)),
+    //read-modify-write done here so no other master can slip in between
+    word value = (this->Hreg(reg) & andmask) | (ormask & ~andmask);
+    this->Hreg(reg, value);
+
+    if (_onWrite) _onWrite(MB_TABLE_HREGS, reg, 1);
+    _reply = MB_REPLY_ECHO;
+}
+
+void Modbus::readWriteRegisters(byte* frame, word readreg, word numread) {
+    word writereg = (word)frame[5] << 8 | (word)frame[6];
+    word numwrite = (word)frame[7] << 8 | (word)frame[8];
+    byte bytecount = frame[9];
+
+    //Check value
+    if (numread < 0x0001 || numread > 0x007D ||
+        numwrite < 0x0001 || numwrite > 0x0079 || bytecount != 2 * numwrite ||
+        _len < 10 + bytecount) {
+        this->exceptionResponse(MB_FC_READ_WRITE_REGS, MB_EX_ILLEGAL_VALUE);
+        return;
+    }
+
+    //Check Address, the whole write range and the start of the read
+    //*** See comments on readCoils method.
+    if (!this->searchRegister(MB_TABLE_HREGS, writereg, numwrite) ||
+        !this->searchRegister(MB_TABLE_HREGS, readreg)) {
+        this->exceptionResponse(MB_FC_READ_WRITE_REGS, MB_EX_ILLEGAL_ADDRESS);
+        return;
+    }
+
+    //The reply is built in place over the request, it must fit the frame
+    if (2 + numread * 2 > MAX_PDU) {
+        this->exceptionResponse(MB_FC_READ_WRITE_REGS, MB_EX_SLAVE_FAILURE);
+        return;
+    }
+
+    //The write is applied before the read
+    word i;
+    for (i = 0; i < numwrite; i++) {
+        this->Hreg(writereg + i, (word)frame[10+i*2] << 8 | (word)frame[11+i*2]);
+    }
+    if (_onWrite) _onWrite(MB_TABLE_HREGS, writereg, numwrite);
+
+    //Build the read reply in place, the written values are no longer needed
+    _len = 2 + numread * 2;
+    _frame[0] = MB_FC_READ_WRITE_REGS;
+    _frame[1] = _len - 2;   //byte count
+
+    word val;
+    for (i = 0; i < numread; i++) {
+        val = this->Hreg(readreg + i);
+        _frame[2 + i * 2] = val >> 8;
+        _frame[3 + i * 2] = val & 0xFF;
+    }
+
+    if (_onRead) _onRead(MB_TABLE_HREGS, readreg, numread);
+    _reply = MB_REPLY_NORMAL;
+}
+
+bool Modbus::addFifo(word address, TRegFifo* fifo) {
+    if (_numFifos >= MB_MAX_FIFOS) return false;
+    _fifoAddr[_numFifos] = address;
+    _fifos[_numFifos] = fifo;
+    _numFifos++;
+    return true;
+}
+
+void Modbus::readFifoQueue(word address) {
+    //Check value (request length)
+    if (_len != 3) {
+        this->exceptionResponse(MB_FC_READ_FIFO_QUEUE, MB_EX_ILLEGAL_VALUE);
+        return;
+    }
+
+    //Check Address
+    TRegFifo* fifo = 0;
+    for (byte f = 0; f < _numFifos; f++) {
+        if (_fifoAddr[f] == address) fifo = _fifos[f];
+    }
+    if (!fifo) {
+        this->exceptionResponse(MB_FC_READ_FIFO_QUEUE, MB_EX_ILLEGAL_ADDRESS);
+        return;
+    }
+
+    //Check value (fifo count)
+    byte tail = fifo->tail;
+    word count = (byte)(fifo->head - tail);
+    if (count > MB_FIFO_MAX_READ) {
+        #ifdef USE_FIFO_PARTIAL_READ
+        //Drain as much as fits one reply, the rest waits for the next request
+        count = MB_FIFO_MAX_READ;
+        #else
+        this->exceptionResponse(MB_FC_READ_FIFO_QUEUE, MB_EX_ILLEGAL_VALUE);
+        return;
+        #endif
+    }
+
+    _len = 5 + count * 2;
+    _frame[0] = MB_FC_READ_FIFO_QUEUE;
+    _frame[1] = (2 + count * 2) >> 8;   //byte count, fifo count included
+    _frame[2] = (2 + count * 2) & 0xFF;
+    _frame[3] = count >> 8;
+    _frame[4] = count & 0xFF;
+
+    for (word i = 0; i < count; i++) {
+        word val = fifo->data[tail & fifo->mask];
+        _frame[5 + i * 2] = val >> 8;
+        _frame[6 + i * 2] = val & 0xFF;
+        tail++;
+    }
+    fifo->tail = tail;
+
     _reply = MB_REPLY_NORMAL;
 }
 
@@ -300,25 +742,22 @@ void Modbus::readCoils(word startreg, word numregs) {
     //When I check all registers in range I got errors in ScadaBR
     //I think that ScadaBR request more than one in the single request
     //when you have more then one datapoint configured from same type.
-    if (!this->searchRegister(startreg + 1)) {
+    if (!this->searchRegister(MB_TABLE_COILS, startreg)) {
         this->exceptionResponse(MB_FC_READ_COILS, MB_EX_ILLEGAL_ADDRESS);
         return;
     }
 
-    //Clean frame buffer
-    free(_frame);
-	_len = 0;
-
     //Determine the message length = function type, byte count and
 	//for each group of 8 registers the message length increases by 1
-	_len = 2 + numregs/8;
-	if (numregs%8) _len++; //Add 1 to the message length for the partial byte.
+	word len = 2 + numregs/8;
+	if (numregs%8) len++; //Add 1 to the message length for the partial byte.
 
-    _frame = (byte *) malloc(_len);
-    if (!_frame) {
+    //The reply is built in place over the request, it must fit the frame
+    if (len > MAX_PDU) {
         this->exceptionResponse(MB_FC_READ_COILS, MB_EX_SLAVE_FAILURE);
         return;
     }
+	_len = len;
 
     _frame[0] = MB_FC_READ_COILS;
     _frame[1] = _len - 2; //byte count (_len - function code and byte count)
@@ -339,6 +778,7 @@ void Modbus::readCoils(word startreg, word numregs) {
 		startreg++;
 	}
 
+    if (_onRead) _onRead(MB_TABLE_COILS, startreg - totregs, totregs);
     _reply = MB_REPLY_NORMAL;
 }
 
@@ -351,25 +791,22 @@ void Modbus::readInputStatus(word startreg, word numregs) {
 
     //Check Address
     //*** See comments on readCoils method.
-    if (!this->searchRegister(startreg + 10001)) {
+    if (!this->searchRegister(MB_TABLE_ISTS, startreg)) {
         this->exceptionResponse(MB_FC_READ_COILS, MB_EX_ILLEGAL_ADDRESS);
         return;
     }
 
-    //Clean frame buffer
-    free(_frame);
-	_len = 0;
-
     //Determine the message length = function type, byte count and
 	//for each group of 8 registers the message length increases by 1
-	_len = 2 + numregs/8;
-	if (numregs%8) _len++; //Add 1 to the message length for the partial byte.
+	word len = 2 + numregs/8;
+	if (numregs%8) len++; //Add 1 to the message length for the partial byte.
 
-    _frame = (byte *) malloc(_len);
-    if (!_frame) {
+    //The reply is built in place over the request, it must fit the frame
+    if (len > MAX_PDU) {
         this->exceptionResponse(MB_FC_READ_INPUT_STAT, MB_EX_SLAVE_FAILURE);
         return;
     }
+	_len = len;
 
     _frame[0] = MB_FC_READ_INPUT_STAT;
     _frame[1] = _len - 2;
@@ -379,7 +816,7 @@ void Modbus::readInputStatus(word startreg, word numregs) {
     word i;
 	while (numregs) {
         i = (totregs - numregs--) / 8;
-		if (this->Ists(startreg))
+		if (this->Image(MB_TABLE_ISTS, startreg))
 			bitSet(_frame[2+i], bitn);
 		else
 			bitClear(_frame[2+i], bitn);
@@ -390,6 +827,7 @@ void Modbus::readInputStatus(word startreg, word numregs) {
 		startreg++;
 	}
 
+    if (_onRead) _onRead(MB_TABLE_ISTS, startreg - totregs, totregs);
     _reply = MB_REPLY_NORMAL;
 }
 
@@ -402,24 +840,21 @@ void Modbus::readInputRegisters(word startreg, word numregs) {
 
     //Check Address
     //*** See comments on readCoils method.
-    if (!this->searchRegister(startreg + 30001)) {
-        this->exceptionResponse(MB_FC_READ_COILS, MB_EX_ILLEGAL_ADDRESS);
+    if (!this->searchRegister(MB_TABLE_IREGS, startreg)) {
+        this->exceptionResponse(MB_FC_READ_INPUT_REGS, MB_EX_ILLEGAL_ADDRESS);
         return;
     }
 
-    //Clean frame buffer
-    free(_frame);
-	_len = 0;
-
 	//calculate the query reply message length
 	//for each register queried add 2 bytes
-	_len = 2 + numregs * 2;
+	word len = 2 + numregs * 2;
 
-    _frame = (byte *) malloc(_len);
-    if (!_frame) {
+    //The reply is built in place over the request, it must fit the frame
+    if (len > MAX_PDU) {
         this->exceptionResponse(MB_FC_READ_INPUT_REGS, MB_EX_SLAVE_FAILURE);
         return;
     }
+	_len = len;
 
     _frame[0] = MB_FC_READ_INPUT_REGS;
     _frame[1] = _len - 2;
@@ -427,8 +862,8 @@ void Modbus::readInputRegisters(word startreg, word numregs) {
     word val;
     word i = 0;
 	while(numregs--) {
-        //retrieve the value from the register bank for the current register
-        val = this->Ireg(startreg + i);
+        //retrieve the value from the committed input image
+        val = this->Image(MB_TABLE_IREGS, startreg + i);
         //write the high byte of the register value
         _frame[2 + i * 2]  = val >> 8;
         //write the low byte of the register value
@@ -436,6 +871,7 @@ void Modbus::readInputRegisters(word startreg, word numregs) {
         i++;
 	}
 
+    if (_onRead) _onRead(MB_TABLE_IREGS, startreg, i);
     _reply = MB_REPLY_NORMAL;
 }
 
@@ -458,6 +894,7 @@ void Modbus::writeSingleCoil(word reg, word status) {
         return;
     }
 
+    if (_onWrite) _onWrite(MB_TABLE_COILS, reg, 1);
     _reply = MB_REPLY_ECHO;
 }
 
@@ -465,28 +902,21 @@ void Modbus::writeMultipleCoils(byte* frame,word startreg, word numoutputs, byte
     //Check value
     word bytecount_calc = numoutputs / 8;
     if (numoutputs%8) bytecount_calc++;
-    if (numoutputs < 0x0001 || numoutputs > 0x07B0 || bytecount != bytecount_calc) {
+    if (numoutputs < 0x0001 || numoutputs > 0x07B0 || bytecount != bytecount_calc ||
+        _len < 6 + bytecount) {
         this->exceptionResponse(MB_FC_WRITE_COILS, MB_EX_ILLEGAL_VALUE);
         return;
     }
 
     //Check Address (startreg...startreg + numregs)
-    for (int k = 0; k < numoutputs; k++) {
-        if (!this->searchRegister(startreg + 1 + k)) {
-            this->exceptionResponse(MB_FC_WRITE_COILS, MB_EX_ILLEGAL_ADDRESS);
-            return;
-        }
-    }
-
-    //Clean frame buffer
-    free(_frame);
-	_len = 5;
-    _frame = (byte *) malloc(_len);
-    if (!_frame) {
-        this->exceptionResponse(MB_FC_WRITE_COILS, MB_EX_SLAVE_FAILURE);
+    if (!this->searchRegister(MB_TABLE_COILS, startreg, numoutputs)) {
+        this->exceptionResponse(MB_FC_WRITE_COILS, MB_EX_ILLEGAL_ADDRESS);
         return;
     }
 
+    //The reply echoes the first 5 bytes of the request, built in place.
+    //The values are read from frame before anything past them is touched.
+	_len = 5;
     _frame[0] = MB_FC_WRITE_COILS;
     _frame[1] = startreg >> 8;
     _frame[2] = startreg & 0x00FF;
@@ -506,9 +936,141 @@ void Modbus::writeMultipleCoils(byte* frame,word startreg, word numoutputs, byte
         startreg++;
 	}
 
+    if (_onWrite) _onWrite(MB_TABLE_COILS, startreg - totoutputs, totoutputs);
     _reply = MB_REPLY_NORMAL;
 }
-#endif
 
+void Modbus::exchangeImage(byte* frame, word numcoils, word numregs) {
+    //Check value (request length)
+    word coilbytes = numcoils / 8;
+    if (numcoils%8) coilbytes++;
+    if (_len != 5 + coilbytes + 2 * (unsigned long)numregs) {
+        this->exceptionResponse(MB_FC_EXCHANGE_IMAGE, MB_EX_ILLEGAL_VALUE);
+        return;
+    }
 
+    //Check Address
+    if (numcoils > this->bankSize(MB_TABLE_COILS) ||
+        numregs > this->bankSize(MB_TABLE_HREGS)) {
+        this->exceptionResponse(MB_FC_EXCHANGE_IMAGE, MB_EX_ILLEGAL_ADDRESS);
+        return;
+    }
 
+    //The reply carries every input, it must fit the frame
+    unsigned long numists = this->bankSize(MB_TABLE_ISTS);
+    unsigned long numiregs = this->bankSize(MB_TABLE_IREGS);
+    unsigned long len = 5 + (numists + 7) / 8 + numiregs * 2;
+    if (len > MAX_PDU) {
+        this->exceptionResponse(MB_FC_EXCHANGE_IMAGE, MB_EX_SLAVE_FAILURE);
+        return;
+    }
+
+    //Apply the outputs first, the reply is then built over the request
+    word first = _banks[MB_TABLE_COILS].first;
+    word i;
+    for (i = 0; i < numcoils; i++) {
+        this->Coil(first + i, bitRead(frame[5 + i / 8], i % 8));
+    }
+
+    byte* regs = frame + 5 + coilbytes;
+    first = _banks[MB_TABLE_HREGS].first;
+    for (i = 0; i < numregs; i++) {
+        this->Hreg(first + i, (word)regs[i * 2] << 8 | (word)regs[i * 2 + 1]);
+    }
+
+    if (_onWrite) {
+        if (numcoils) _onWrite(MB_TABLE_COILS, _banks[MB_TABLE_COILS].first, numcoils);
+        if (numregs) _onWrite(MB_TABLE_HREGS, first, numregs);
+    }
+
+    _len = len;
+    _frame[0] = MB_FC_EXCHANGE_IMAGE;
+    _frame[1] = numists >> 8;
+    _frame[2] = numists & 0x00FF;
+    _frame[3] = numiregs >> 8;
+    _frame[4] = numiregs & 0x00FF;
+
+    first = _banks[MB_TABLE_ISTS].first;
+    for (i = 0; i < numists; i++) {
+        if (i % 8 == 0) _frame[5 + i / 8] = 0;
+        if (this->Image(MB_TABLE_ISTS, first + i))
+            bitSet(_frame[5 + i / 8], i % 8);
+    }
+
+    regs = _frame + 5 + (numists + 7) / 8;
+    first = _banks[MB_TABLE_IREGS].first;
+    for (i = 0; i < numiregs; i++) {
+        word val = this->Image(MB_TABLE_IREGS, first + i);
+        regs[i * 2] = val >> 8;
+        regs[i * 2 + 1] = val & 0xFF;
+    }
+
+    if (_onRead) {
+        if (numists) _onRead(MB_TABLE_ISTS, _banks[MB_TABLE_ISTS].first, numists);
+        if (numiregs) _onRead(MB_TABLE_IREGS, first, numiregs);
+    }
+    _reply = MB_REPLY_NORMAL;
+}
+
+void Modbus::readChanges(byte* frame, word startreg, word numregs) {
+    byte fcode = frame[5];
+    word epoch = (word)frame[6] << 8 | (word)frame[7];
+    word since = (word)frame[8] << 8 | (word)frame[9];
+
+    //Check value (request length, table)
+    if (_len != 10 || numregs < 0x0001 ||
+        (fcode != MB_FC_READ_INPUT_STAT && fcode != MB_FC_READ_INPUT_REGS)) {
+        this->exceptionResponse(MB_FC_READ_CHANGES, MB_EX_ILLEGAL_VALUE);
+        return;
+    }
+
+    //Check Address (startreg...startreg + numregs)
+    byte table = fcode == MB_FC_READ_INPUT_STAT ? MB_TABLE_ISTS : MB_TABLE_IREGS;
+    if (!this->searchRegister(table, startreg, numregs)) {
+        this->exceptionResponse(MB_FC_READ_CHANGES, MB_EX_ILLEGAL_ADDRESS);
+        return;
+    }
+
+    //A since from before the slave restarted, one the sequence has not
+    //reached yet, or one gone more than half way around, cannot be
+    //compared: the master gets everything
+    TRegBank *bank = &_banks[table];
+    word seq = bank->seq;
+    bool all = !since || epoch != _epoch || (word)(seq - since) >= 0x8000;
+
+    //Pairs are built in place from byte 8 on, the request is already read
+    word maxpairs = (MAX_PDU - 8) / 4;
+    byte pairs = 0;
+    word i;
+    for (i = 0; i < numregs; i++) {
+        word offset = startreg + i;
+        if (!all && (word)(seq - bank->stamp[offset - bank->first]) >= (word)(seq - since))
+            continue;
+        if (pairs == maxpairs) break;
+
+        word val = this->Image(table, offset);
+        _frame[8 + pairs * 4] = offset >> 8;
+        _frame[9 + pairs * 4] = offset & 0xFF;
+        _frame[10 + pairs * 4] = val >> 8;
+        _frame[11 + pairs * 4] = val & 0xFF;
+        pairs++;
+    }
+
+    //The range is done once next comes back as start, start + count would
+    //wrap to 0 for a range ending at 65535
+    word next = i < numregs ? startreg + i : startreg;
+
+    _len = 8 + pairs * 4;
+    _frame[0] = MB_FC_READ_CHANGES;
+    _frame[1] = _epoch >> 8;
+    _frame[2] = _epoch & 0xFF;
+    _frame[3] = seq >> 8;
+    _frame[4] = seq & 0xFF;
+    _frame[5] = next >> 8;
+    _frame[6] = next & 0xFF;
+    _frame[7] = pairs;
+
+    if (_onRead && i) _onRead(table, startreg, i);
+    _reply = MB_REPLY_NORMAL;
+}
+#endif
@@ -4,11 +4,91 @@ Copyright (C) 2014 André Sarmento Barbosa
 */
 #include "ModbusSerial.h"
 
-ModbusSerial::ModbusSerial() {
+#ifdef USE_USART_ISR
+#if defined(USART_RX_vect)
+#define MB_USART_RX_vect USART_RX_vect
+#else
+#define MB_USART_RX_vect USART0_RX_vect
+#endif
+
+#if defined(USART_UDRE_vect)
+#define MB_USART_UDRE_vect USART_UDRE_vect
+#define MB_USART_TX_vect USART_TX_vect
+#else
+#define MB_USART_UDRE_vect USART0_UDRE_vect
+#define MB_USART_TX_vect USART0_TX_vect
+#endif
+
+static ModbusSerial* _usartOwner = 0;
+
+ISR(MB_USART_RX_vect) {
+  _usartOwner->usartRx();
+}
+
+ISR(MB_USART_UDRE_vect) {
+  _usartOwner->usartUdre();
+}
+
+ISR(MB_USART_TX_vect) {
+  _usartOwner->usartTxc();
+}
+
+//Timer0 ticks (64 cycles, 4 us at 16 MHz) read the way micros() does, but
+//only the low 16 bits and without the scaling, so timing every received
+//byte stays cheap. Call with interrupts disabled.
+extern volatile unsigned long timer0_overflow_count;
 
+static inline word rxTicks() {
+  byte t = TCNT0;
+  byte ovf = timer0_overflow_count;
+  if ((TIFR0 & _BV(TOV0)) && t < 255) ovf++;
+  return (word)ovf << 8 | t;
+}
+
+static word usTicks(unsigned long us) {
+  unsigned long ticks = us * (F_CPU / 1000000L) / 64;
+  return ticks > 0xFFFF ? 0xFFFF : ticks;
+}
+
+static word ticksUs(word ticks) {
+  unsigned long us = (unsigned long)ticks * 64 / (F_CPU / 1000000L);
+  return us > 0xFFFF ? 0xFFFF : us;
+}
+#endif
+
+ModbusSerial::ModbusSerial() {
+  crcInit();
+  _slaveId = 1;
+  _numGroups = 0;
+  _diag = false;
+  #ifdef USE_USART_ISR
+  _rxHead = _rxStart = _rxTail = 0;
+  _rxFrameHead = _rxFrameTail = 0;
+  _txState = MB_TX_IDLE;
+  _txDone = 0;
+  _txPort = 0;
+  _baudNew = 0;
+  _baudOld = 0;
+  _rxOverruns = _overrunsShown = 0;
+  #ifdef USE_ADAPTIVE_TIMING
+  _rxGapMax = _gapNew = 0;
+  _gapGood = 0;
+  _gapBad = false;
+  _txReplied = false;
+  _turnaround = 0;
+  _adapt = false;
+  #endif
+  #else
+  _rxState = MB_RX_IDLE;
+  _rxLen = 0;
+  _rxCrc = 0xFFFF;
+  #endif
+  _rxError = false;
+  _rxLast = 0;
 }
 
 bool ModbusSerial::setSlaveId(byte slaveId){
+  if (slaveId == MB_ADDRESS_BROADCAST || slaveId > MB_MAX_SLAVE_ID) return false;
   _slaveId = slaveId;
   return true;
 }
@@ -17,18 +97,40 @@ byte ModbusSerial::getSlaveId() {
   return _slaveId;
 }
 
-#ifndef __AVR_ATmega32U4__
-#ifndef DEBUG_MODE
-bool ModbusSerial::config(HardwareSerial* port, long baud, int txPin) {
-  this->_port = port;
-  this->_txPin = txPin;
-  (*port).begin(baud);
+bool ModbusSerial::addGroup(byte groupId) {
+  if (groupId == MB_ADDRESS_BROADCAST || groupId == _slaveId || this->isGroup(groupId) ||
+      _numGroups >= MB_MAX_GROUPS) return false;
+  _groups[_numGroups++] = groupId;
+  return true;
+}
 
-  if (txPin >= 0) {
-    pinMode(txPin, OUTPUT);
-    digitalWrite(txPin, LOW);
+//Adds MB_DIAG_REGS input registers from firstReg on with the line timing
+//and MB_CONFIG_REGS holding registers from configReg on to set it up
+void ModbusSerial::diagnostics(word firstReg, word configReg) {
+  _diagReg = firstReg;
+  _configReg = configReg;
+  _diag = true;
+  for (byte r = 0; r < MB_DIAG_REGS; r++) this->addIreg(firstReg + r);
+  for (byte r = 0; r < MB_CONFIG_REGS; r++) this->addHreg(configReg + r);
+  this->Ireg(firstReg + MB_DIAG_T15, _t15);
+  this->Ireg(firstReg + MB_DIAG_T35, _t35);
+}
+
+bool ModbusSerial::isGroup(byte address) {
+  for (byte g = 0; g < _numGroups; g++) {
+    if (_groups[g] == address) return true;
   }
+  return false;
+}
 
+//Function codes a broadcast or group frame may carry
+static bool isBroadcastFunction(byte fcode) {
+  return fcode == MB_FC_WRITE_COIL || fcode == MB_FC_WRITE_REG ||
+         fcode == MB_FC_WRITE_COILS || fcode == MB_FC_WRITE_REGS ||
+         fcode == MB_FC_MASK_WRITE_REG || fcode == MB_FC_SET_BAUD;
+}
+
+void ModbusSerial::setTimeouts(long baud) {
   // Modbus states that a baud rate higher than 19200 must use a fixed 750 us
   // for inter character time out and 1.75 ms for a frame delay for baud rates
   // below 19200 the timing is more critical and has to be calculated.
@@ -40,7 +142,11 @@ bool ModbusSerial::config(HardwareSerial* port, long baud, int txPin) {
   // Thus the formula is T1.5(us) = (1000ms * 1000(us) * 1.5 * 11bits)/baud
   // 1000ms * 1000(us) * 1.5 * 11bits = 16500000 can be calculated as a constant
 
-  if (baud > 19200)
+  if (baud > MB_BAUD_FIXED_MAX) {
+    _t15 = 16500000/baud;
+    if (_t15 < MB_T15_MIN) _t15 = MB_T15_MIN;
+  }
+  else if (baud > 19200)
   _t15 = 750;
   else
   _t15 = 16500000/baud; // 1T * 1.5 = T1.5
@@ -53,6 +159,85 @@ bool ModbusSerial::config(HardwareSerial* port, long baud, int txPin) {
   should suffice without holding the bus line high for too long.*/
 
   _t35 = _t15 * 3.5;
+}
+
+#ifdef USE_USART_ISR
+bool ModbusSerial::config(long baud, int txPin) {
+  this->_port = 0;
+  this->_txPin = txPin;
+  _usartOwner = this;
+
+  this->setBaud(baud);
+  UCSR0C = _BV(UCSZ01) | _BV(UCSZ00); //8N1
+  UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);
+
+  //The driver enable pin is released from the TXC interrupt, so keep its
+  //port register and bit instead of going through digitalWrite()
+  if (txPin >= 0) {
+    pinMode(txPin, OUTPUT);
+    digitalWrite(txPin, LOW);
+    _txPort = portOutputRegister(digitalPinToPort(txPin));
+    _txMask = digitalPinToBitMask(txPin);
+  }
+
+  return true;
+}
+
+//Picks the divisor closest to baud, normal or double speed, and returns the
+//error of the rate it makes in per mille
+static word baudDivisor(long baud, bool &u2x, word &ubrr) {
+  word best = 0xFFFF;
+  for (byte div = 16; div >= 8; div -= 8) {
+    unsigned long n = ((unsigned long)F_CPU + (unsigned long)baud * div / 2) / ((unsigned long)baud * div);
+    if (n < 1) n = 1;
+    if (n > 4096) n = 4096;
+    unsigned long rate = F_CPU / (div * n);
+    unsigned long diff = rate > (unsigned long)baud ? rate - baud : baud - rate;
+    word error = diff * 1000 / baud;
+    if (error < best) {
+      best = error;
+      u2x = (div == 8);
+      ubrr = n - 1;
+    }
+  }
+  return best;
+}
+
+void ModbusSerial::setBaud(long baud) {
+  bool u2x = false;
+  word ubrr = 0;
+  baudDivisor(baud, u2x, ubrr);
+  UCSR0A = u2x ? _BV(U2X0) : 0;
+  UBRR0H = ubrr >> 8;
+  UBRR0L = ubrr;
+  this->_baud = baud;
+  this->setTimeouts(baud);
+  _rxChar = usTicks(11000000 / baud);
+  _rxT15 = usTicks(_t15 + 11000000 / baud);
+  _rxT35 = usTicks(_t35 + 11000000 / baud);
+
+  #ifdef USE_ADAPTIVE_TIMING
+  _t15Base = _t15;
+  _t35Base = _t35;
+  _gapPeak = 0;
+  _gapFrames = 0;
+  #endif
+}
+#endif
+
+#ifndef __AVR_ATmega32U4__
+#if !defined(DEBUG_MODE) && !defined(USE_USART_ISR)
+bool ModbusSerial::config(HardwareSerial* port, long baud, int txPin) {
+  this->_port = port;
+  this->_txPin = txPin;
+  (*port).begin(baud);
+
+  if (txPin >= 0) {
+    pinMode(txPin, OUTPUT);
+    digitalWrite(txPin, LOW);
+  }
+
+  this->setTimeouts(baud);
 
   return true;
 }
@@ -72,12 +257,7 @@ bool ModbusSerial::config(HardwareSerial* port,
       digitalWrite(txPin, LOW);
     }
 
-    if (baud > 19200)
-    _t15 = 750;
-    else
-    _t15 = 16500000/baud; // 1T * 1.5 = T1.5
-
-    _t35 = _t15 * 3.5;
+    this->setTimeouts(baud);
 
     return true;
   }
@@ -96,12 +276,7 @@ bool ModbusSerial::config(HardwareSerial* port,
       digitalWrite(txPin, LOW);
     }
 
-    if (baud > 19200)
-    _t15 = 750;
-    else
-    _t15 = 16500000/baud; // 1T * 1.5 = T1.5
-
-    _t35 = _t15 * 3.5;
+    this->setTimeouts(baud);
 
     return true;
   }
@@ -123,12 +298,7 @@ bool ModbusSerial::config(HardwareSerial* port,
         digitalWrite(txPin, LOW);
       }
 
-      if (baud > 19200)
-      _t15 = 750;
-      else
-      _t15 = 16500000/baud; // 1T * 1.5 = T1.5
-
-      _t35 = _t15 * 3.5;
+      this->setTimeouts(baud);
 
       return true;
   }
@@ -144,12 +314,7 @@ bool ModbusSerial::config(HardwareSerial* port,
       digitalWrite(txPin, LOW);
     }
 
-    if (baud > 19200)
-    _t15 = 750;
-    else
-    _t15 = 16500000/baud; // 1T * 1.5 = T1.5
-
-    _t35 = _t15 * 3.5;
+    this->setTimeouts(baud);
 
     return true;
   }
@@ -157,84 +322,449 @@ bool ModbusSerial::config(HardwareSerial* port,
   #endif
 
   bool ModbusSerial::receive(byte* frame) {
+    //Smallest valid frame is address + function code + crc
+    if (_len < 4) {
+      return false;
+    }
+
     //first byte of frame = address
     byte address = frame[0];
-    //Last two bytes = crc
-    u_int crc = ((frame[_len - 2] << 8) | frame[_len - 1]);
 
-    //Slave Check
-    if (address != 0xFF && address != this->getSlaveId()) {
-      return false;
+    //Slave Check, broadcast and group frames are only taken for writes
+    bool unicast = (address == this->getSlaveId());
+    if (!unicast) {
+      if (address != MB_ADDRESS_BROADCAST && !this->isGroup(address)) return false;
+      if (!isBroadcastFunction(frame[1])) return false;
     }
 
-    //CRC Check
-    if (crc != this->calcCrc(_frame[0], _frame+1, _len-3)) {
-      return false;
-    }
+    //The CRC was checked by the receiver while the frame arrived
 
     //PDU starts after first byte
     //framesize PDU = framesize - address(1) - crc(2)
-    this->receivePDU(frame+1);
-    //No reply to Broadcasts
-    if (address == 0xFF) _reply = MB_REPLY_OFF;
+    //The handlers build the reply PDU in place over the request.
+    _frame = frame+1;
+    _len = _len-3;
+    #ifdef USE_USART_ISR
+    //The line speed belongs to the serial layer, not to the registers
+    if (_frame[0] == MB_FC_SET_BAUD) {
+      this->baudRequest();
+      if (!unicast) _reply = MB_REPLY_OFF;
+      return true;
+    }
+    #endif
+    this->receivePDU(_frame);
+    //No reply to broadcast and group writes
+    if (!unicast) _reply = MB_REPLY_OFF;
     return true;
   }
 
+  #ifdef USE_USART_ISR
+  void ModbusSerial::usartRx() {
+    byte status = UCSR0A;
+    byte c = UDR0;
+    word now = rxTicks();
+    word gap = now - _rxLast;
+
+    //The time since the previous byte decides where this one belongs:
+    //more than t3.5 starts a new frame, more than t1.5 breaks the open one
+    if (_rxHead != _rxStart) {
+      if (gap > _rxT35) this->closeFrame();
+      else {
+        if (gap > _rxT15) _rxError = true;
+        #ifdef USE_ADAPTIVE_TIMING
+        if (gap > _rxGapMax) _rxGapMax = gap;
+        #endif
+      }
+    }
+    #ifdef USE_ADAPTIVE_TIMING
+    //First byte of the request following our reply
+    if (_rxHead == _rxStart && _txReplied) {
+      unsigned long turnaround = micros() - _txDone;
+      _turnaround = turnaround > 0xFFFF ? 0xFFFF : turnaround;
+      _txReplied = false;
+    }
+    #endif
+    _rxLast = now;
+
+    if ((status & (_BV(FE0) | _BV(DOR0) | _BV(UPE0))) ||
+        (word)(_rxHead - _rxTail) >= MB_RX_RING ||
+        (word)(_rxHead - _rxStart) >= MAX_FRAME) {
+      if (status & _BV(DOR0)) _rxOverruns++;
+      _rxError = true;
+      return;
+    }
+    _rxRing[_rxHead & (MB_RX_RING - 1)] = c;
+    _rxHead++;
+  }
+
+  //Queue the open frame for task(), or drop it if it was broken. The CRC
+  //is left to task(). Runs with interrupts disabled.
+  void ModbusSerial::closeFrame() {
+    #ifdef USE_ADAPTIVE_TIMING
+    //Only a silence past t1.5 holds against the timing, an overrun or a
+    //framing error says nothing about it
+    if (_rxGapMax > _rxT15) _gapBad = true;
+    else if (!_rxError && _gapGood < 0xFF) _gapGood++;
+    if (_rxGapMax > _gapNew) _gapNew = _rxGapMax;
+    _rxGapMax = 0;
+    #endif
+
+    if (_rxError || (byte)(_rxFrameHead - _rxFrameTail) >= MB_RX_FRAMES) {
+      _rxHead = _rxStart;
+    } else {
+      _rxEnds[_rxFrameHead & (MB_RX_FRAMES - 1)] = _rxHead;
+      _rxFrameHead++;
+    }
+    _rxStart = _rxHead;
+    _rxError = false;
+  }
+
+  void ModbusSerial::task() {
+    //The ISR only closes a frame when the next one starts, close the last
+    //one here once the line has been silent for t3.5
+    byte sreg = SREG;
+    cli();
+    if (_rxHead != _rxStart && (word)(rxTicks() - _rxLast) > _rxT35 - _rxChar) this->closeFrame();
+    bool ready = _rxFrameHead != _rxFrameTail;
+    word overruns = _rxOverruns;
+    word start = _rxTail;
+    word end = _rxEnds[_rxFrameTail & (MB_RX_FRAMES - 1)];
+    //The next request waits until the last reply has left the line and
+    //t3.5 has passed since, the reply is built over _adu
+    bool txBusy = _txState != MB_TX_IDLE || micros() - _txDone < _t35;
+    SREG = sreg;
+
+    if (_diag && overruns != _overrunsShown) {
+      _overrunsShown = overruns;
+      this->Ireg(_diagReg + MB_DIAG_OVERRUNS, overruns);
+    }
+
+    #ifdef USE_ADAPTIVE_TIMING
+    if (_gapGood || _gapBad) this->calibrate();
+    #endif
+
+    if (txBusy) return;
+
+    //A baud switch waits until the reply is out, then the old speed comes
+    //back unless a good frame arrives at the new one within the timeout
+    if (_baudNew) {
+      _baudOld = _baud;
+      this->switchBaud(_baudNew);
+      _baudNew = 0;
+      _baudSince = millis();
+      return;
+    }
+    if (_baudOld && millis() - _baudSince > _baudTimeout) {
+      this->switchBaud(_baudOld);
+      _baudOld = 0;
+      return;
+    }
+
+    if (!ready) return;
+
+    word len = end - start;
+    for (word i = 0; i < len; i++) {
+      _adu[i] = _rxRing[(start + i) & (MB_RX_RING - 1)];
+    }
+
+    sreg = SREG;
+    cli();
+    _rxTail = end;
+    _rxFrameTail++;
+    SREG = sreg;
+
+    //The CRC run over a whole frame including its own CRC bytes is zero
+    if (crcBlock(0xFFFF, _adu, len) != 0) {
+      #ifdef USE_ADAPTIVE_TIMING
+      _gapBad = true;
+      #endif
+      return;
+    }
+
+    //Only a frame the master sent to this slave confirms the new speed,
+    //traffic with other slaves does not show it still reaches this one
+    if (_adu[0] == _slaveId || _adu[0] == MB_ADDRESS_BROADCAST || this->isGroup(_adu[0])) {
+      _baudOld = 0;
+    }
+
+    _len = len;
+    this->frameReady();
+
+    #ifdef USE_ADAPTIVE_TIMING
+    //A write to MB_CONFIG_TIMING applies before the next frame
+    if (_diag && (this->Hreg(_configReg + MB_CONFIG_TIMING) != 0) != _adapt) this->calibrate();
+    #endif
+  }
+
+  //Checks a MB_FC_SET_BAUD request in _frame, the switch itself waits for
+  //task() once the echo is out
+  void ModbusSerial::baudRequest() {
+    long baud = (long)_frame[1] << 24 | (long)_frame[2] << 16 |
+                (long)_frame[3] << 8 | (long)_frame[4];
+    word timeout = (word)_frame[5] << 8 | (word)_frame[6];
+    bool u2x;
+    word ubrr;
+
+    //Check value (request length, rate, timeout). The range check comes
+    //first, baudDivisor() would overflow on rates far outside it
+    if (_len != 7 || baud < (long)MB_BAUD_MIN || baud > (long)MB_BAUD_MAX || timeout == 0 ||
+        baudDivisor(baud, u2x, ubrr) > MB_BAUD_TOLERANCE) {
+      this->exceptionResponse(MB_FC_SET_BAUD, MB_EX_ILLEGAL_VALUE);
+      return;
+    }
+
+    _baudNew = baud;
+    _baudTimeout = timeout;
+    _reply = MB_REPLY_ECHO;
+  }
+
+  //Bytes caught half way through the change are garbage, the open frame
+  //and any queued one are dropped with them
+  void ModbusSerial::switchBaud(long baud) {
+    byte sreg = SREG;
+    cli();
+    this->setBaud(baud);
+    _rxHead = _rxStart = _rxTail;
+    _rxFrameTail = _rxFrameHead;
+    _rxError = false;
+    SREG = sreg;
+  }
+
+  #ifdef USE_ADAPTIVE_TIMING
+  //Folds the frames closed by the ISR into the gap peak and moves t1.5 and
+  //t3.5 with it, see MB_CALIBRATE_FRAMES
+  void ModbusSerial::calibrate() {
+    byte sreg = SREG;
+    cli();
+    word gap = _gapNew;
+    byte good = _gapGood;
+    bool bad = _gapBad;
+    word turnaround = _turnaround;
+    _gapNew = 0;
+    _gapGood = 0;
+    _gapBad = false;
+    SREG = sreg;
+
+    //The interrupt measured silence plus one character, in ticks
+    unsigned int charUs = 11000000 / _baud;
+    gap = ticksUs(gap);
+    gap = gap > charUs ? gap - charUs : 0;
+
+    if (bad) {
+      unsigned long raised = (unsigned long)_gapPeak * 2;
+      if (raised < gap) raised = gap;
+      if (raised < _t15Base * 2UL / 3) raised = _t15Base * 2UL / 3;
+      _gapPeak = raised > MB_T15_MAX * 2UL / 3 ? MB_T15_MAX * 2UL / 3 : raised;
+      _gapFrames = 0;
+    } else {
+      for (byte f = 0; f < good; f++) _gapPeak -= _gapPeak / 16;
+      if (gap > _gapPeak) _gapPeak = gap;
+      _gapFrames = _gapFrames + good > MB_CALIBRATE_FRAMES ? MB_CALIBRATE_FRAMES : _gapFrames + good;
+    }
+
+    unsigned int t15 = _t15Base;
+    unsigned int t35 = _t35Base;
+    _adapt = _diag && this->Hreg(_configReg + MB_CONFIG_TIMING);
+    if (_adapt) {
+      unsigned int t15Min = _t15Base;
+      unsigned int t35Min = _t35Base;
+      if (_gapFrames >= MB_CALIBRATE_FRAMES) {
+        t15Min = 16500000 / _baud;
+        t35Min = 38500000 / _baud;
+        if (t15Min < MB_T15_MIN) t15Min = MB_T15_MIN;
+      }
+
+      unsigned long want = (unsigned long)_gapPeak + _gapPeak / 2;
+      t15 = want > MB_T15_MAX ? MB_T15_MAX : want;
+      if (t15 < t15Min) t15 = t15Min;
+      want = (unsigned long)t15 + 2 * charUs;
+      t35 = want < t35Min ? t35Min : want;
+    }
+
+    sreg = SREG;
+    cli();
+    _t15 = t15;
+    _t35 = t35;
+    _rxT15 = usTicks(t15 + charUs);
+    _rxT35 = usTicks(t35 + charUs);
+    SREG = sreg;
+
+    if (_diag) {
+      this->Ireg(_diagReg + MB_DIAG_T15, t15);
+      this->Ireg(_diagReg + MB_DIAG_T35, t35);
+      this->Ireg(_diagReg + MB_DIAG_GAP, _gapPeak);
+      this->Ireg(_diagReg + MB_DIAG_TURNAROUND, turnaround);
+    }
+  }
+  #endif
+
   bool ModbusSerial::send(byte* frame) {
-    byte i;
+    //address + PDU + crc, already complete
+    if (frame != _adu) memmove(_adu, frame, _len + 3);
+    this->startTx(_len + 3, false);
+    return true;
+  }
 
-    if (this->_txPin >= 0) {
-      digitalWrite(this->_txPin, HIGH);
-      delay(1);
+  bool ModbusSerial::sendPDU(byte* pduframe) {
+    //The request was only taken after t3.5 of silence, so the reply can
+    //start right away. The CRC is added by the TX interrupt.
+    if (pduframe != _adu + 1) memmove(_adu + 1, pduframe, _len);
+    _adu[0] = _slaveId;
+    this->startTx(_len + 1, true);
+    return true;
+  }
+
+  //Queue len bytes of _adu for the TX interrupts and return
+  void ModbusSerial::startTx(word len, bool addCrc) {
+    byte sreg = SREG;
+    cli();
+    _txLen = len;
+    _txPos = 0;
+    _txCrc = 0xFFFF;
+    _txAddCrc = addCrc;
+    _txState = MB_TX_DATA;
+    if (_txPort) *_txPort |= _txMask;
+    UCSR0B |= _BV(UDRIE0);
+    SREG = sreg;
+  }
+
+  void ModbusSerial::usartUdre() {
+    byte c;
+
+    switch (_txState) {
+      case MB_TX_DATA:
+        c = _adu[_txPos++];
+        _txCrc = crcUpdate(_txCrc, c);
+        if (_txPos == _txLen) _txState = _txAddCrc ? MB_TX_CRC_HI : MB_TX_DRAIN;
+      break;
+
+      case MB_TX_CRC_HI:
+        c = _txCrc >> 8;
+        _txState = MB_TX_CRC_LO;
+      break;
+
+      case MB_TX_CRC_LO:
+        c = _txCrc & 0xFF;
+        _txState = MB_TX_DRAIN;
+      break;
+
+      default:
+        UCSR0B &= ~_BV(UDRIE0);
+        return;
     }
 
-    for (i = 0 ; i < _len ; i++) {
-      (*_port).write(frame[i]);
+    //Clear TXC with every byte so it only fires once the last one is out
+    UCSR0A = (UCSR0A & _BV(U2X0)) | _BV(TXC0);
+    UDR0 = c;
+
+    if (_txState == MB_TX_DRAIN) {
+      UCSR0B = (UCSR0B & ~_BV(UDRIE0)) | _BV(TXCIE0);
     }
+  }
 
-    (*_port).flush();
-    delayMicroseconds(_t35);
+  //Last stop bit is on the line, release the RS-485 driver
+  void ModbusSerial::usartTxc() {
+    UCSR0B &= ~_BV(TXCIE0);
+    if (_txPort) *_txPort &= ~_txMask;
+    _txDone = micros();
+    _txState = MB_TX_IDLE;
+    #ifdef USE_ADAPTIVE_TIMING
+    _txReplied = true;
+    #endif
+  }
+  #else
+  void ModbusSerial::task() {
+    unsigned long now = micros();
+    bool pending = (*_port).available() > 0;
+
+    //Frame boundaries are found from the time elapsed since the last byte
+    //was read, so this never waits on the port. Silence is only trusted
+    //when the port was seen empty, a slow loop() with bytes still queued
+    //just means the frame is still arriving.
+    if (_rxState != MB_RX_IDLE) {
+      unsigned long gap = now - _rxLast;
+
+      if (gap > _t35 && (!pending || _rxState == MB_RX_GAP)) {
+        this->polledFrameReady();
+      } else if (!pending && gap > _t15) {
+        _rxState = MB_RX_GAP;
+      } else if (pending && _rxState == MB_RX_GAP) {
+        //t1.5 < silence < t3.5 inside a frame, the frame is not OK
+        _rxError = true;
+      }
+    }
+
+    while ((*_port).available()) {
+      byte c = (*_port).read();
+      //A frame that doesn't fit the ADU buffer can't be valid, drop it
+      if (_rxLen < MAX_FRAME) _adu[_rxLen++] = c;
+      else _rxError = true;
+      _rxCrc = crcUpdate(_rxCrc, c);
+      _rxState = MB_RX_RECEIVING;
+      _rxLast = micros();
+    }
+  }
+
+  void ModbusSerial::polledFrameReady() {
+    //The CRC run over a whole frame including its own CRC bytes is zero
+    bool valid = !_rxError && _rxCrc == 0;
+    _len = _rxLen;
+
+    _rxState = MB_RX_IDLE;
+    _rxError = false;
+    _rxLen = 0;
+    _rxCrc = 0xFFFF;
+
+    if (valid) this->frameReady();
+  }
+
+  bool ModbusSerial::send(byte* frame) {
+    word i;
 
     if (this->_txPin >= 0) {
-      digitalWrite(this->_txPin, LOW);
+      digitalWrite(this->_txPin, HIGH);
     }
+
+    //address + PDU + crc
+    for (i = 0 ; i < _len + 3 ; i++) {
+      (*_port).write(frame[i]);
+    }
+
+    this->endTx();
+    return true;
   }
 
   bool ModbusSerial::sendPDU(byte* pduframe) {
+    //The request was only taken after t3.5 of silence, so the reply can
+    //start right away
     if (this->_txPin >= 0) {
       digitalWrite(this->_txPin, HIGH);
-      delay(1);
     }
 
-    delayMicroseconds(_t35);
-
-    //Send slaveId
+    //Send slaveId. The CRC of each byte is folded in while the previous
+    //one is still being shifted out.
     (*_port).write(_slaveId);
+    word crc = crcUpdate(0xFFFF, _slaveId);
 
     //Send PDU
-    byte i;
+    word i;
     for (i = 0 ; i < _len ; i++) {
       (*_port).write(pduframe[i]);
+      crc = crcUpdate(crc, pduframe[i]);
     }
 
     //Send CRC
-    word crc = calcCrc(_slaveId, _frame, _len);
     (*_port).write(crc >> 8);
     (*_port).write(crc & 0xFF);
 
-    (*_port).flush();
-    delayMicroseconds(_t35);
-
-    if (this->_txPin >= 0) {
-      digitalWrite(this->_txPin, LOW);
-    }
+    this->endTx();
 
     #ifdef DEBUG_MODE
     (*DebugPort).println("SENT Serial RESPONSE");
     (*DebugPort).print(_slaveId);
     (*DebugPort).print(':');
     for (int i = 0 ; i < _len ; i++) {
-      (*DebugPort).print(_frame[i]);
+      (*DebugPort).print(pduframe[i]);
       (*DebugPort).print(':');
     }
     (*DebugPort).print(crc >> 8);
@@ -244,26 +774,26 @@ bool ModbusSerial::config(HardwareSerial* port,
     (*DebugPort).println();
     (*DebugPort).println(F("-----------------"));
     #endif
+    return true;
   }
 
-  void ModbusSerial::task() {
-    _len = 0;
-
-    while ((*_port).available() > _len)	{
-      _len = (*_port).available();
-      delayMicroseconds(_t15);
+  //HardwareSerial drains its TX buffer from an interrupt already, only
+  //an RS-485 driver has to wait for the last bit before releasing the bus
+  void ModbusSerial::endTx() {
+    if (this->_txPin >= 0) {
+      (*_port).flush();
+      digitalWrite(this->_txPin, LOW);
     }
+  }
 
-    if (_len == 0) return;
-
-    byte i;
-    _frame = (byte*) malloc(_len);
-    for (i=0 ; i < _len ; i++) _frame[i] = (*_port).read();
+  #endif
 
+  //Process the frame of _len bytes waiting in _adu
+  void ModbusSerial::frameReady() {
     #ifdef DEBUG_MODE
     (*DebugPort).println(F("GOT Serial CMD"));
     for (int i=0 ; i < _len ; i++) {
-      (*DebugPort).print(_frame[i], DEC);
+      (*DebugPort).print(_adu[i], DEC);
       (*DebugPort).print(":");
       //(*DebugPort).println(sendbuffer[i], HEX);
     }
@@ -271,30 +801,18 @@ bool ModbusSerial::config(HardwareSerial* port,
     (*DebugPort).println(F("-----------------"));
     #endif
 
-    if (this->receive(_frame)) {
+    if (this->receive(_adu)) {
       if (_reply == MB_REPLY_NORMAL)
       this->sendPDU(_frame);
       else
       if (_reply == MB_REPLY_ECHO)
-      this->send(_frame);
+      this->send(_adu);
     }
 
-    free(_frame);
     _len = 0;
   }
 
   word ModbusSerial::calcCrc(byte address, byte* pduFrame, byte pduLen) {
-    byte CRCHi = 0xFF, CRCLo = 0x0FF, Index;
-
-    Index = CRCHi ^ address;
-    CRCHi = CRCLo ^ _auchCRCHi[Index];
-    CRCLo = _auchCRCLo[Index];
-
-    while (pduLen--) {
-      Index = CRCHi ^ *pduFrame++;
-      CRCHi = CRCLo ^ _auchCRCHi[Index];
-      CRCLo = _auchCRCLo[Index];
-    }
-
-    return (CRCHi << 8) | CRCLo;
+    word crc = crcUpdate(0xFFFF, address);
+    return crcBlock(crc, pduFrame, pduLen);
   }
@@ -0,0 +1,129 @@
+/*
+    PulseCounter.cpp - High speed counter inputs for the OpenPLC firmware
+*/
+#include "PulseCounter.h"
+
+//Shared with the pin interrupts, one slot per counter
+static volatile uint32_t _edges[MAX_COUNTERS];
+static volatile unsigned long _edgeTime[MAX_COUNTERS];
+
+#define COUNTER_ISR(n) \
+  static void counterIsr##n() { \
+    _edges[n]++; \
+    _edgeTime[n] = micros(); \
+  }
+
+COUNTER_ISR(0)
+COUNTER_ISR(1)
+#if MAX_COUNTERS > 2
+COUNTER_ISR(2)
+COUNTER_ISR(3)
+COUNTER_ISR(4)
+COUNTER_ISR(5)
+#endif
+
+static void (* const _counterIsr[MAX_COUNTERS])() = {
+  counterIsr0, counterIsr1,
+  #if MAX_COUNTERS > 2
+  counterIsr2, counterIsr3, counterIsr4, counterIsr5,
+  #endif
+};
+
+PulseCounter::PulseCounter() {
+  _modbus = 0;
+  _count = 0;
+}
+
+void PulseCounter::begin(Modbus* modbus, const uint8_t* pins, uint8_t count, word firstReg,
+                         int mode, word gateMs, word timeoutMs) {
+  _modbus = modbus;
+  _count = count > MAX_COUNTERS ? MAX_COUNTERS : count;
+  _firstReg = firstReg;
+  _gate = gateMs;
+  _timeout = timeoutMs;
+  _lastGate = millis();
+
+  for (uint8_t n = 0; n < _count; n++) {
+    for (uint8_t r = 0; r < COUNTER_REGS; r++)
+      _modbus->addIreg(_firstReg + n * COUNTER_REGS + r);
+
+    _edges[n] = 0;
+    _prevEdges[n] = 0;
+    _running[n] = false;
+    _period[n] = 0;
+    _freq[n] = 0;
+
+    if (digitalPinToInterrupt(pins[n]) == NOT_AN_INTERRUPT) continue;
+    pinMode(pins[n], INPUT);
+    attachInterrupt(digitalPinToInterrupt(pins[n]), _counterIsr[n], mode);
+  }
+}
+
+//delta edges in span us as milli-Hz, delta * 10^9 / span. A 64 bit divide
+//is a long library call on AVR, so this is a long division in three steps
+//of 1000 in 32 bits. The remainder times 1000 must fit, so spans longer
+//than 2^22 us (a gate over 4 s) first drop their low bits, still keeping
+//22 significant ones.
+static uint32_t frequency(uint32_t delta, unsigned long span) {
+  uint8_t shift = 0;
+  while (span > 0x400000UL) {
+    span >>= 1;
+    shift++;
+  }
+
+  uint32_t q = delta / span;
+  uint32_t r = delta % span;
+  for (uint8_t i = 0; i < 3; i++) {
+    r *= 1000;
+    q = q * 1000 + r / span;
+    r %= span;
+  }
+  return q >> shift;
+}
+
+void PulseCounter::publish(word reg, uint32_t value) {
+  _modbus->Ireg(reg, value >> 16);
+  _modbus->Ireg(reg + 1, value & 0xFFFF);
+}
+
+void PulseCounter::task() {
+  if (!_count) return;
+
+  unsigned long now = millis();
+  bool gate = now - _lastGate >= _gate;
+  if (gate) _lastGate = now;
+
+  for (uint8_t n = 0; n < _count; n++) {
+    MB_ATOMIC_BEGIN
+    uint32_t edges = _edges[n];
+    unsigned long time = _edgeTime[n];
+    MB_ATOMIC_END
+
+    word reg = _firstReg + n * COUNTER_REGS;
+    this->publish(reg + COUNTER_REG_COUNT, edges);
+    if (!gate) continue;
+
+    uint32_t delta = edges - _prevEdges[n];
+    if (delta) {
+      //The first edges after power up or a timeout only start the time
+      //base, the last edge before the pause is no reference for them
+      if (_running[n]) {
+        unsigned long span = time - _prevTime[n];
+        if (span) {
+          _period[n] = span / delta;
+          _freq[n] = frequency(delta, span);
+        }
+      }
+      _running[n] = true;
+      _prevEdges[n] = edges;
+      _prevTime[n] = time;
+    } else if (micros() - time > _timeout * 1000UL) {
+      _running[n] = false;
+      _period[n] = 0;
+      _freq[n] = 0;
+    }
+
+    this->publish(reg + COUNTER_REG_PERIOD, _period[n]);
+    this->publish(reg + COUNTER_REG_FREQ, _freq[n]);
+  }
+}
@@ -0,0 +1,99 @@
+/*
+    PwmOutput.cpp - 16 bit PWM analog outputs for the OpenPLC firmware
+*/
+#include "PwmOutput.h"
+
+//Clock select values and their prescalers, the same on every 16 bit timer
+static const word _prescale[] = {1, 8, 64, 256, 1024};
+
+PwmOutput::PwmOutput() {
+  _ch = 0;
+  _count = 0;
+}
+
+void PwmOutput::begin(const uint8_t* pins, uint8_t count, unsigned long freqHz) {
+  _ch = (TPwmChannel*) calloc(count, sizeof(TPwmChannel));
+  if (!_ch) return;
+  _count = count;
+
+  #ifdef __AVR__
+  //Slowest prescaler that still fits the period in 16 bits
+  if (!freqHz) freqHz = 1;
+  unsigned long top = 0xFFFF;
+  _cs = 5;
+  for (byte i = 0; i < 5; i++) {
+    top = F_CPU / _prescale[i] / freqHz;
+    if (top <= 0x10000) {
+      _cs = i + 1;
+      break;
+    }
+  }
+  if (top < 2) top = 2;
+  if (top > 0x10000) top = 0x10000;
+  _top = top - 1;
+  #endif
+
+  for (uint8_t i = 0; i < _count; i++) {
+    TPwmChannel* c = &_ch[i];
+    c->pin = pins[i];
+    c->ocr = 0;
+    c->written = false;
+
+    //The mode, enable and clock select bits sit at the same place in
+    //every 16 bit timer, Timer1's names are used for all of them
+    switch (digitalPinToTimer(c->pin)) {
+      #ifdef __AVR__
+      case TIMER1A: attach(c, &OCR1A, &TCCR1A, 1 << COM1A1, &TCCR1B, &ICR1); break;
+      case TIMER1B: attach(c, &OCR1B, &TCCR1A, 1 << COM1B1, &TCCR1B, &ICR1); break;
+      #endif
+      #if defined(__AVR_ATmega2560__)
+      case TIMER1C: attach(c, &OCR1C, &TCCR1A, 1 << COM1C1, &TCCR1B, &ICR1); break;
+      case TIMER3A: attach(c, &OCR3A, &TCCR3A, 1 << COM1A1, &TCCR3B, &ICR3); break;
+      case TIMER3B: attach(c, &OCR3B, &TCCR3A, 1 << COM1B1, &TCCR3B, &ICR3); break;
+      case TIMER3C: attach(c, &OCR3C, &TCCR3A, 1 << COM1C1, &TCCR3B, &ICR3); break;
+      case TIMER4A: attach(c, &OCR4A, &TCCR4A, 1 << COM1A1, &TCCR4B, &ICR4); break;
+      case TIMER4B: attach(c, &OCR4B, &TCCR4A, 1 << COM1B1, &TCCR4B, &ICR4); break;
+      case TIMER4C: attach(c, &OCR4C, &TCCR4A, 1 << COM1C1, &TCCR4B, &ICR4); break;
+      #endif
+      default: break;
+    }
+  }
+}
+
+void PwmOutput::attach(TPwmChannel* c, volatile uint16_t* ocr, volatile uint8_t* tccrA, uint8_t com,
+                       volatile uint8_t* tccrB, volatile uint16_t* icr) {
+  c->ocr = ocr;
+  c->tccr = tccrA;
+  c->com = com;
+
+  //Fast PWM with ICRn as TOP (mode 14). The enable bits of the other
+  //outputs of the timer are left alone.
+  #ifdef __AVR__
+    *tccrA = (*tccrA & 0xFC) | (1 << WGM11);
+    *tccrB = (1 << WGM13) | (1 << WGM12) | _cs;
+    *icr = _top;
+  #endif
+}
+
+void PwmOutput::write(uint8_t output, word value) {
+  if (output >= _count) return;
+  TPwmChannel* c = &_ch[output];
+  if (c->written && c->value == value) return;
+  c->value = value;
+  c->written = true;
+
+  if (!c->ocr) {
+    analogWrite(c->pin, value >> 8);
+    return;
+  }
+
+  //0 disconnects the output, fast PWM would still give a one clock spike
+  if (!value) {
+    *c->tccr &= ~c->com;
+    digitalWrite(c->pin, LOW);
+    return;
+  }
+
+  *c->ocr = ((unsigned long)value * ((unsigned long)_top + 1)) >> 16;
+  *c->tccr |= c->com;
+}
@@ -0,0 +1,44 @@
+/*
+    PwmOutput.h - 16 bit PWM analog outputs for the OpenPLC firmware
+*/
+#include <Arduino.h>
+
+#ifndef PWMOUTPUT_H
+#define PWMOUTPUT_H
+
+//Analog output on a 16 bit timer pin (Timer1 on the Uno: pins 9 and 10,
+//Timer1/3/4 on the Mega: pins 2, 3, 5-8, 11 and 12) runs in fast PWM mode
+//with ICRn as TOP, so the period is set by the configured frequency and
+//the duty keeps as many of the 16 register bits as TOP allows: all of them
+//below ~245 Hz, 15 at 490 Hz, 14 at 1 kHz. Other pins go through
+//analogWrite() with the top 8 bits. That includes Mega pin 13, which the
+//core drives from OC0A although OC1C shares it: Timer0 is off limits, it
+//runs millis()/micros() and triggers the analog capture. Timer5 is left
+//to the pulse trains. Either way the hardware is only touched when the
+//value changes.
+typedef struct TPwmChannel {
+    uint8_t pin;
+    volatile uint16_t* ocr;     // compare register, 0 for analogWrite() pins
+    volatile uint8_t* tccr;     // TCCRnA, holds the output enable
+    uint8_t com;                // output enable bit in tccr
+    word value;                 // last value written
+    bool written;
+} TPwmChannel;
+
+class PwmOutput {
+    private:
+        TPwmChannel* _ch;
+        uint8_t _count;
+        word _top;
+        byte _cs;
+
+        void attach(TPwmChannel* c, volatile uint16_t* ocr, volatile uint8_t* tccrA, uint8_t com,
+                    volatile uint8_t* tccrB, volatile uint16_t* icr);
+
+    public:
+        PwmOutput();
+        void begin(const uint8_t* pins, uint8_t count, unsigned long freqHz = 490);
+        void write(uint8_t output, word value);
+};
+
+#endif //PWMOUTPUT_H
@@ -0,0 +1,55 @@
+/*
+    ModbusExchange.cpp - Master side of MB_FC_EXCHANGE_IMAGE (0x41)
+*/
+#include <string.h>
+#include "ModbusExchange.h"
+
+int mbxEncodeRequest(uint8_t* pdu, size_t size,
+                     const bool* coils, uint16_t numcoils,
+                     const uint16_t* hregs, uint16_t numregs) {
+    size_t coilbytes = (numcoils + 7) / 8;
+    size_t len = 5 + coilbytes + 2 * (size_t)numregs;
+    if (len > size || len > MBX_MAX_PDU) return 0;
+
+    pdu[0] = MBX_FC;
+    pdu[1] = numcoils >> 8;
+    pdu[2] = numcoils & 0xFF;
+    pdu[3] = numregs >> 8;
+    pdu[4] = numregs & 0xFF;
+
+    //Bits LSB first as in FC15, unused bits of the last byte are 0
+    memset(pdu + 5, 0, coilbytes);
+    for (uint16_t i = 0; i < numcoils; i++) {
+        if (coils[i]) pdu[5 + i / 8] |= 1 << (i % 8);
+    }
+
+    uint8_t* regs = pdu + 5 + coilbytes;
+    for (uint16_t i = 0; i < numregs; i++) {
+        regs[i * 2] = hregs[i] >> 8;
+        regs[i * 2 + 1] = hregs[i] & 0xFF;
+    }
+    return (int)len;
+}
+
+int mbxDecodeReply(const uint8_t* pdu, size_t len, MbxInputs* in) {
+    if (len == 2 && pdu[0] == (MBX_FC | 0x80)) return pdu[1];
+    if (len < 5 || pdu[0] != MBX_FC) return MBX_BAD_REPLY;
+
+    uint16_t numists = (uint16_t)pdu[1] << 8 | pdu[2];
+    uint16_t numiregs = (uint16_t)pdu[3] << 8 | pdu[4];
+    size_t istbytes = (numists + 7) / 8;
+    if (len != 5 + istbytes + 2 * (size_t)numiregs) return MBX_BAD_REPLY;
+    if (numists > in->maxists || numiregs > in->maxiregs) return MBX_TOO_MANY;
+
+    for (uint16_t i = 0; i < numists; i++) {
+        in->ists[i] = (pdu[5 + i / 8] >> (i % 8)) & 0x01;
+    }
+
+    const uint8_t* regs = pdu + 5 + istbytes;
+    for (uint16_t i = 0; i < numiregs; i++) {
+        in->iregs[i] = (uint16_t)regs[i * 2] << 8 | regs[i * 2 + 1];
+    }
+    in->numists = numists;
+    in->numiregs = numiregs;
+    return MBX_OK;
+}
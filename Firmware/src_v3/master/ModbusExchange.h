@@ -0,0 +1,55 @@
+/*
+    ModbusExchange.h - Master side of MB_FC_EXCHANGE_IMAGE (0x41)
+
+    Builds the request PDU and parses the reply PDU of the process image
+    exchange served by the Modbus library of the firmware, so the host can
+    replace its FC01/02/03/04/15/16 polls of a board with one round trip.
+    Plain C++ with no Arduino or bus dependency: the caller adds the slave
+    address and the CRC, or hands the PDU to a stack that does, e.g. with
+    libmodbus
+
+        int len = mbxEncodeRequest(pdu, sizeof(pdu), coils, nc, hregs, nr);
+        modbus_send_raw_request(ctx, raw, len + 1);  // raw = slave id + pdu
+        len = modbus_receive_confirmation(ctx, rsp); // rsp = slave id + pdu
+        int res = mbxDecodeReply(rsp + 1, len - 3, &img);
+
+    The layout is documented with MB_FC_EXCHANGE_IMAGE in Modbus.h.
+*/
+#ifndef MODBUSEXCHANGE_H
+#define MODBUSEXCHANGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MBX_FC              0x41
+#define MBX_MAX_PDU         253     // as MAX_PDU of the slave
+
+//mbxDecodeReply() results besides the exception codes sent by the slave
+#define MBX_OK              0
+#define MBX_BAD_REPLY       -1      // wrong function code or length
+#define MBX_TOO_MANY        -2      // more inputs than the image can hold
+
+//Inputs read back by one exchange. The caller points ists and iregs at
+//its own arrays and sets the max fields; numists and numiregs are set to
+//what the slave sent, each from the first register of its table.
+typedef struct MbxInputs {
+    bool*     ists;
+    uint16_t  maxists;
+    uint16_t  numists;
+    uint16_t* iregs;
+    uint16_t  maxiregs;
+    uint16_t  numiregs;
+} MbxInputs;
+
+//Builds the request writing numcoils coils and numregs holding registers,
+//each from the first register of its table. Returns the PDU length, or 0
+//if it does not fit size or a frame.
+int mbxEncodeRequest(uint8_t* pdu, size_t size,
+                     const bool* coils, uint16_t numcoils,
+                     const uint16_t* hregs, uint16_t numregs);
+
+//Parses a reply PDU of len bytes into in. Returns MBX_OK, the exception
+//code (1..255) the slave answered with, or MBX_BAD_REPLY/MBX_TOO_MANY.
+int mbxDecodeReply(const uint8_t* pdu, size_t len, MbxInputs* in);
+
+#endif //MODBUSEXCHANGE_H
@@ -0,0 +1,64 @@
+/*
+    Arduino.h - Host stand-in for the Arduino core, enough to build the
+    Modbus library for the tests in this directory
+*/
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t byte;
+typedef uint16_t word;
+typedef bool boolean;
+
+#define HIGH 1
+#define LOW  0
+
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+#define bitWrite(value, bit, bitvalue) (bitvalue ? bitSet(value, bit) : bitClear(value, bit))
+
+#define PROGMEM
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+#define F(s) s
+
+#define INPUT  0
+#define OUTPUT 1
+
+inline void pinMode(int, int) {}
+inline void digitalWrite(int, int) {}
+
+//Time seen by the library, the tests move it forward
+inline unsigned long& hostMicros() { static unsigned long t = 0; return t; }
+inline unsigned long micros() { return hostMicros(); }
+inline unsigned long millis() { return hostMicros() / 1000; }
+
+//Serial port with a receive queue the test fills and a transmit buffer it
+//reads back
+class Stream {
+    public:
+        byte rx[512];
+        word rxHead = 0, rxTail = 0;
+        byte tx[512];
+        word txLen = 0;
+
+        int available() { return rxHead - rxTail; }
+        int read() { return rxTail < rxHead ? rx[rxTail++] : -1; }
+        size_t write(uint8_t c) {
+            if (txLen < sizeof(tx)) tx[txLen++] = c;
+            return 1;
+        }
+        void flush() {}
+};
+
+class HardwareSerial : public Stream {
+    public:
+        void begin(long) {}
+        operator bool() { return true; }
+};
+
+#endif //ARDUINO_H
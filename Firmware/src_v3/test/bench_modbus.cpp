@@ -0,0 +1,58 @@
+/*
+    bench_modbus.cpp - Request service time against register count
+
+    Times FC03 reads and FC06 writes at the end of a table of N holding
+    registers, the worst place for a list walk. Only the public API and
+    receivePDU() are used, so the same file also builds against an older
+    Modbus.cpp for a before/after comparison:
+        make bench_modbus MODBUS_DIR=<dir with the old Modbus.h/.cpp>
+*/
+#include <stdio.h>
+#include <chrono>
+#include "Modbus.h"
+
+class BenchModbus : public Modbus {
+    public:
+        //The frame is heap allocated because older versions free it and
+        //allocate the reply, the cost of that is part of what is measured
+        word request(const byte* pdu, byte len) {
+            byte* frame = (byte *) malloc(256);
+            memcpy(frame, pdu, len);
+            _frame = frame;
+            _len = len;
+            this->receivePDU(_frame);
+            word reply = _len;
+            free(_frame);
+            return reply;
+        }
+};
+
+static double timeRequest(BenchModbus& mb, const byte* pdu, byte len, long rounds) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (long r = 0; r < rounds; r++) mb.request(pdu, len);
+    std::chrono::duration<double, std::micro> took = std::chrono::steady_clock::now() - start;
+    return took.count() / rounds;
+}
+
+int main() {
+    const word sizes[] = {16, 64, 125, 256, 1024, 4096};
+
+    printf("%8s %16s %16s\n", "regs", "FC03 x125 (us)", "FC06 last (us)");
+    for (byte s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        word count = sizes[s];
+        BenchModbus* mb = new BenchModbus();
+        for (word i = 0; i < count; i++) mb->addHreg(i, i);
+
+        word numregs = count < 125 ? count : 125;
+        word start = count - numregs;
+        byte fc03[] = {0x03, (byte)(start >> 8), (byte)start, 0x00, (byte)numregs};
+        byte fc06[] = {0x06, (byte)((count - 1) >> 8), (byte)(count - 1), 0x12, 0x34};
+
+        long rounds = 2000000L / count + 100;
+        double read = timeRequest(*mb, fc03, sizeof(fc03), rounds);
+        double write = timeRequest(*mb, fc06, sizeof(fc06), rounds);
+        printf("%8u %16.3f %16.3f\n", count, read, write);
+        delete mb;
+    }
+    return 0;
+}
@@ -0,0 +1,97 @@
+/*
+    bench_turnaround.cpp - Work between the end of a request and the first
+    reply byte, with the CRC checked after the frame (before) and with the
+    CRC accumulated as bytes arrive and leave (after)
+
+    Before: the whole request is run through the CRC once t3.5 has passed,
+    then the handler runs, then the whole reply is run through the CRC
+    before its first byte goes out.
+    After: the receive interrupt has already folded every byte into the CRC,
+    so the check is one compare, and the reply CRC is folded in by the
+    transmit interrupt while the bytes leave.
+*/
+#include <stdio.h>
+#include <chrono>
+#include "Modbus.h"
+#include "ModbusCrc.h"
+
+class BenchModbus : public Modbus {
+    public:
+        byte adu[MAX_FRAME];
+
+        void handle(const byte* request, word len) {
+            memcpy(adu, request, len);
+            _frame = adu + 1;
+            _len = len - 3;
+            this->receivePDU(_frame);
+        }
+
+        word replyLen() { return _len + 1; }
+};
+
+static volatile word sink;
+
+//Builds an ADU with its CRC from address + PDU
+static word makeAdu(byte* adu, const byte* pdu, word len) {
+    adu[0] = 1;
+    memcpy(adu + 1, pdu, len);
+    word crc = crcBlock(0xFFFF, adu, len + 1);
+    adu[len + 1] = crc >> 8;
+    adu[len + 2] = crc & 0xFF;
+    return len + 3;
+}
+
+static void run(const char* name, BenchModbus& mb, const byte* request, word len) {
+    const long rounds = 200000;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::duration<double, std::micro> took;
+
+    //Before: check the request, handle it, then compute the reply CRC
+    start = std::chrono::steady_clock::now();
+    for (long r = 0; r < rounds; r++) {
+        word crc = crcBlock(0xFFFF, request, len - 2);
+        if (crc != ((word)request[len - 2] << 8 | request[len - 1])) return;
+        mb.handle(request, len);
+        sink = crcBlock(0xFFFF, mb.adu, mb.replyLen());
+    }
+    took = std::chrono::steady_clock::now() - start;
+    double before = took.count() / rounds;
+
+    //After: the residue of the frame was computed on arrival, compare it
+    word residue = crcBlock(0xFFFF, request, len);
+    start = std::chrono::steady_clock::now();
+    for (long r = 0; r < rounds; r++) {
+        if (residue != 0) return;
+        mb.handle(request, len);
+        sink = mb.replyLen();
+    }
+    took = std::chrono::steady_clock::now() - start;
+    double after = took.count() / rounds;
+
+    //What moved off the critical path, spread over the byte times
+    start = std::chrono::steady_clock::now();
+    for (long r = 0; r < rounds; r++) sink = crcUpdate(0xFFFF, request[r & 7]);
+    took = std::chrono::steady_clock::now() - start;
+
+    printf("%-32s %5u -> %5u bytes  before %7.3f us  after %7.3f us  (%.4f us per byte in the ISR)\n",
+           name, len, mb.replyLen() + 2, before, after, took.count() / rounds);
+}
+
+int main() {
+    crcInit();
+    BenchModbus mb;
+    for (word i = 0; i < 125; i++) mb.addHreg(i, i);
+
+    byte read[MAX_FRAME];
+    const byte fc03[] = {0x03, 0x00, 0x00, 0x00, 125};
+    word readLen = makeAdu(read, fc03, sizeof(fc03));
+
+    byte write[MAX_FRAME];
+    byte fc16[6 + 246] = {0x10, 0x00, 0x00, 0x00, 123, 246};
+    for (word i = 0; i < 246; i++) fc16[6 + i] = i;
+    word writeLen = makeAdu(write, fc16, sizeof(fc16));
+
+    run("FC03 read 125 registers", mb, read, readLen);
+    run("FC16 write 123 registers", mb, write, writeLen);
+    return 0;
+}
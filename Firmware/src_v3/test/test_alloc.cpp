@@ -0,0 +1,92 @@
+/*
+    test_alloc.cpp - Checks that serving requests never touches the heap
+
+    Registers are added first, then every supported function code is sent
+    through receivePDU(). Link with -Wl,--wrap=malloc,--wrap=calloc,
+    --wrap=realloc,--wrap=free so each call is counted.
+*/
+#include <stdio.h>
+#include "Modbus.h"
+
+extern "C" {
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* p, size_t size);
+void  __real_free(void* p);
+
+static unsigned long allocs = 0;
+
+void* __wrap_malloc(size_t size) { allocs++; return __real_malloc(size); }
+void* __wrap_calloc(size_t n, size_t size) { allocs++; return __real_calloc(n, size); }
+void* __wrap_realloc(void* p, size_t size) { allocs++; return __real_realloc(p, size); }
+void  __wrap_free(void* p) { if (p) allocs++; __real_free(p); }
+}
+
+class TestModbus : public Modbus {
+    public:
+        byte buf[MAX_PDU];
+
+        //Sends one request PDU, returns the reply length
+        word request(const byte* pdu, word len) {
+            memcpy(buf, pdu, len);
+            _frame = buf;
+            _len = len;
+            _reply = 0;
+            this->receivePDU(_frame);
+            return _len;
+        }
+};
+
+static int failures = 0;
+
+static void check(const char* name, const byte* pdu, word len, TestModbus& mb) {
+    unsigned long before = allocs;
+    word reply = mb.request(pdu, len);
+    unsigned long used = allocs - before;
+    printf("%-30s reply %3u bytes  heap calls %lu\n", name, reply, used);
+    if (used != 0 || (mb.buf[0] & 0x80)) failures++;
+}
+
+int main() {
+    TestModbus mb;
+    for (word i = 0; i < 64; i++) {
+        mb.addCoil(i);
+        mb.addIsts(i);
+        mb.addIreg(i, i);
+        mb.addHreg(i, i);
+    }
+    mb.commit();
+
+    //The banks are allocated while registers are added, which also proves
+    //the counting wrappers are linked in
+    printf("%-30s heap calls %lu\n", "setup (addReg)", allocs);
+    if (allocs == 0) failures++;
+
+    const byte fc01[] = {0x01, 0x00, 0x00, 0x00, 0x40};
+    const byte fc02[] = {0x02, 0x00, 0x00, 0x00, 0x40};
+    const byte fc03[] = {0x03, 0x00, 0x00, 0x00, 0x40};
+    const byte fc04[] = {0x04, 0x00, 0x00, 0x00, 0x40};
+    const byte fc05[] = {0x05, 0x00, 0x03, 0xFF, 0x00};
+    const byte fc06[] = {0x06, 0x00, 0x03, 0x12, 0x34};
+    const byte fc15[] = {0x0F, 0x00, 0x00, 0x00, 0x10, 0x02, 0xA5, 0x5A};
+    const byte fc16[] = {0x10, 0x00, 0x00, 0x00, 0x02, 0x04, 0x00, 0x01, 0x00, 0x02};
+
+    check("FC01 read 64 coils", fc01, sizeof(fc01), mb);
+    check("FC02 read 64 inputs", fc02, sizeof(fc02), mb);
+    check("FC03 read 64 holding regs", fc03, sizeof(fc03), mb);
+    check("FC04 read 64 input regs", fc04, sizeof(fc04), mb);
+    check("FC05 write coil", fc05, sizeof(fc05), mb);
+    check("FC06 write register", fc06, sizeof(fc06), mb);
+    check("FC15 write 16 coils", fc15, sizeof(fc15), mb);
+    check("FC16 write 2 registers", fc16, sizeof(fc16), mb);
+
+    //Exceptions are built in place as well
+    unsigned long before = allocs;
+    const byte bad[] = {0x03, 0xFF, 0x00, 0x00, 0x01};
+    mb.request(bad, sizeof(bad));
+    printf("%-30s reply %3u bytes  heap calls %lu\n", "FC03 illegal address", 2, allocs - before);
+    if (allocs != before || mb.buf[1] != MB_EX_ILLEGAL_ADDRESS) failures++;
+
+    printf(failures ? "FAIL\n" : "PASS\n");
+    return failures ? 1 : 0;
+}
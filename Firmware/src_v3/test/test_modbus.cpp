@@ -0,0 +1,478 @@
+/*
+    test_modbus.cpp - Checks the reply bytes of the Modbus slave
+
+    Each case sends one request PDU through receivePDU() and compares the
+    whole reply with the one the spec asks for, or for the user defined
+    codes with what the standard ones answer. Link with -Wl,--wrap=calloc
+    so the heap can be limited to what a Mega has left for the banks.
+*/
+#include <stdio.h>
+#include "Modbus.h"
+#include "ModbusExchange.h"
+#include "Scheduler.h"
+
+extern "C" {
+void* __real_calloc(size_t n, size_t size);
+
+//Bytes the banks may still take, about what the Mega sketch leaves free.
+//Each case starts with all of it.
+#define HEAP_SIZE   6000
+static unsigned long heapLeft;
+
+void* __wrap_calloc(size_t n, size_t size) {
+    if ((unsigned long)n * size > heapLeft) return 0;
+    heapLeft -= n * size;
+    return __real_calloc(n, size);
+}
+}
+
+class TestModbus : public Modbus {
+    public:
+        byte buf[MAX_PDU];
+
+        //Sends one request PDU, returns the reply length
+        word request(const byte* pdu, word len) {
+            memcpy(buf, pdu, len);
+            _frame = buf;
+            _len = len;
+            _reply = 0;
+            this->receivePDU(_frame);
+            return _len;
+        }
+
+        byte reply() { return _reply; }
+};
+
+static int failures = 0;
+
+static void fail(const char* name, const char* why) {
+    printf("FAIL %s: %s\n", name, why);
+    failures++;
+}
+
+//Sends pdu and compares the reply with expected
+static void expect(TestModbus& mb, const char* name, const byte* pdu, word len,
+                   const byte* expected, word explen) {
+    word reply = mb.request(pdu, len);
+    if (reply != explen || memcmp(mb.buf, expected, explen)) {
+        printf("FAIL %s: got", name);
+        for (word i = 0; i < reply; i++) printf(" %02X", mb.buf[i]);
+        printf("\n");
+        failures++;
+    }
+}
+
+#define EXPECT(mb, name, pdu, ...) do { \
+    const byte req[] = pdu; \
+    const byte rep[] = __VA_ARGS__; \
+    expect(mb, name, req, sizeof(req), rep, sizeof(rep)); \
+} while (0)
+#define PDU(...) {__VA_ARGS__}
+
+//Offsets between two added registers are not registers
+static void testSparse() {
+    TestModbus mb;
+    mb.addHreg(0, 0x1111);
+    mb.addHreg(1, 0x2222);
+    mb.addHreg(10, 0xAAAA);
+    mb.addIreg(4, 0x0404);
+    mb.addIreg(8, 0x0808);
+    mb.addCoil(0, true);
+    mb.addCoil(9, true);
+    mb.commit();
+
+    EXPECT(mb, "FC03 added", PDU(0x03, 0x00, 0x00, 0x00, 0x02),
+           {0x03, 0x04, 0x11, 0x11, 0x22, 0x22});
+    EXPECT(mb, "FC03 hole", PDU(0x03, 0x00, 0x05, 0x00, 0x01),
+           {0x83, 0x02});
+    EXPECT(mb, "FC03 last", PDU(0x03, 0x00, 0x0A, 0x00, 0x01),
+           {0x03, 0x02, 0xAA, 0xAA});
+    EXPECT(mb, "FC04 hole", PDU(0x04, 0x00, 0x06, 0x00, 0x01),
+           {0x84, 0x02});
+    EXPECT(mb, "FC01 hole", PDU(0x01, 0x00, 0x03, 0x00, 0x01),
+           {0x81, 0x02});
+    EXPECT(mb, "FC06 hole", PDU(0x06, 0x00, 0x05, 0x12, 0x34),
+           {0x86, 0x02});
+    EXPECT(mb, "FC05 hole", PDU(0x05, 0x00, 0x05, 0xFF, 0x00),
+           {0x85, 0x02});
+    EXPECT(mb, "FC16 across hole",
+           PDU(0x10, 0x00, 0x01, 0x00, 0x02, 0x04, 0x00, 0x01, 0x00, 0x02),
+           {0x90, 0x02});
+    EXPECT(mb, "FC15 across hole", PDU(0x0F, 0x00, 0x00, 0x00, 0x02, 0x01, 0x03),
+           {0x8F, 0x02});
+
+    //Only the added registers are dirty, holes never reach the sketch
+    word offset = 0;
+    int dirty = 0;
+    for (; mb.nextDirty(MB_TABLE_HREGS, offset); offset++) {
+        if (offset != 0 && offset != 1 && offset != 10) fail("dirty", "hole reported");
+        dirty++;
+    }
+    if (dirty != 3) fail("dirty", "added register missing");
+
+    //Adding a hole later makes it a register
+    mb.addHreg(5, 0x5555);
+    offset = 0;
+    EXPECT(mb, "FC03 filled hole", PDU(0x03, 0x00, 0x05, 0x00, 0x01),
+           {0x03, 0x02, 0x55, 0x55});
+    if (!mb.nextDirty(MB_TABLE_HREGS, offset) || offset != 5)
+        fail("dirty", "filled hole not dirty");
+}
+
+//A layout too sparse for the heap is reported, the bank stays usable
+static void testAllocFailure() {
+    TestModbus mb;
+    if (!mb.addIreg(0, 0x1234)) fail("addIreg(0)", "failed");
+    if (mb.addIreg(60000)) fail("addIreg(60000)", "did not report the failure");
+    if (!mb.addHreg(100) || !mb.addHreg(0)) fail("addHreg", "failed");
+    mb.commit();
+
+    EXPECT(mb, "FC04 after failure", PDU(0x04, 0x00, 0x00, 0x00, 0x01),
+           {0x04, 0x02, 0x12, 0x34});
+    EXPECT(mb, "FC04 failed register", PDU(0x04, 0xEA, 0x60, 0x00, 0x01),
+           {0x84, 0x02});
+}
+
+//Builds the map of a board: coils, inputs and registers from offset 0
+static void addBoard(TestModbus& mb) {
+    for (word i = 0; i < 12; i++) mb.addCoil(i);
+    for (word i = 0; i < 12; i++) mb.addHreg(i);
+    for (word i = 0; i < 24; i++) mb.addIsts(i, i % 3 == 0);
+    for (word i = 0; i < 16; i++) mb.addIreg(i, 0x0101 * i + 0x8000);
+    mb.commit();
+}
+
+//One 0x41 round trip leaves the slave as FC15 plus FC16 do and returns
+//what FC02 and FC04 read
+static void testExchangeImage() {
+    TestModbus mb, ref;
+    addBoard(mb);
+    addBoard(ref);
+
+    bool coils[12];
+    uint16_t hregs[12];
+    for (int i = 0; i < 12; i++) {
+        coils[i] = (i * 5) % 7 < 3;
+        hregs[i] = 0x1000 + i * 0x0111;
+    }
+
+    byte pdu[MBX_MAX_PDU];
+    int len = mbxEncodeRequest(pdu, sizeof(pdu), coils, 12, hregs, 12);
+    if (len != 5 + 2 + 24) fail("0x41 encode", "length");
+    word reply = mb.request(pdu, len);
+
+    bool ists[32];
+    uint16_t iregs[32];
+    MbxInputs in = {ists, 32, 0, iregs, 32, 0};
+    if (mbxDecodeReply(mb.buf, reply, &in) != MBX_OK) fail("0x41 decode", "failed");
+    if (in.numists != 24 || in.numiregs != 16) fail("0x41 decode", "counts");
+
+    //The same outputs written the plain way
+    byte fc15[] = {0x0F, 0x00, 0x00, 0x00, 0x0C, 0x02, 0x00, 0x00};
+    for (int i = 0; i < 12; i++)
+        if (coils[i]) fc15[6 + i / 8] |= 1 << (i % 8);
+    ref.request(fc15, sizeof(fc15));
+    byte fc16[6 + 24] = {0x10, 0x00, 0x00, 0x00, 0x0C, 0x18};
+    for (int i = 0; i < 12; i++) {
+        fc16[6 + i * 2] = hregs[i] >> 8;
+        fc16[7 + i * 2] = hregs[i] & 0xFF;
+    }
+    ref.request(fc16, sizeof(fc16));
+
+    //Outputs: FC01/FC03 of both slaves answer byte for byte the same
+    const byte reads[][5] = {
+        {0x01, 0x00, 0x00, 0x00, 0x0C},
+        {0x03, 0x00, 0x00, 0x00, 0x0C},
+    };
+    for (int r = 0; r < 2; r++) {
+        word n = ref.request(reads[r], 5);
+        byte expected[MAX_PDU];
+        memcpy(expected, ref.buf, n);
+        expect(mb, r ? "0x41 vs FC03" : "0x41 vs FC01", reads[r], 5, expected, n);
+    }
+
+    //Inputs: the decoded image matches FC02/FC04
+    const byte fc02[] = {0x02, 0x00, 0x00, 0x00, 0x18};
+    mb.request(fc02, sizeof(fc02));
+    for (int i = 0; i < 24; i++) {
+        if (ists[i] != (bool)bitRead(mb.buf[2 + i / 8], i % 8)) fail("0x41 vs FC02", "input");
+    }
+    const byte fc04[] = {0x04, 0x00, 0x00, 0x00, 0x10};
+    mb.request(fc04, sizeof(fc04));
+    for (int i = 0; i < 16; i++) {
+        if (iregs[i] != ((word)mb.buf[2 + i * 2] << 8 | mb.buf[3 + i * 2])) fail("0x41 vs FC04", "register");
+    }
+
+    //A request for more outputs than the slave has comes back as exception 02
+    bool many[16] = {false};
+    len = mbxEncodeRequest(pdu, sizeof(pdu), many, 16, hregs, 0);
+    reply = mb.request(pdu, len);
+    if (mbxDecodeReply(mb.buf, reply, &in) != MB_EX_ILLEGAL_ADDRESS) fail("0x41 too many coils", "no exception 02");
+
+    //An image larger than the host arrays is refused, not overrun
+    len = mbxEncodeRequest(pdu, sizeof(pdu), coils, 0, hregs, 0);
+    reply = mb.request(pdu, len);
+    MbxInputs small = {ists, 8, 0, iregs, 32, 0};
+    if (mbxDecodeReply(mb.buf, reply, &small) != MBX_TOO_MANY) fail("0x41 small image", "not refused");
+}
+
+//FC23, quantities and addresses are checked before anything is written,
+//then the write is applied before the read
+static void testReadWriteRegisters() {
+    TestModbus mb;
+    for (word i = 0; i < 10; i++) mb.addHreg(i, 0x0101 * i);
+
+    EXPECT(mb, "FC23 write then read",
+           PDU(0x17, 0x00, 0x00, 0x00, 0x04, 0x00, 0x02, 0x00, 0x02, 0x04, 0xAA, 0xAA, 0xBB, 0xBB),
+           {0x17, 0x08, 0x00, 0x00, 0x01, 0x01, 0xAA, 0xAA, 0xBB, 0xBB});
+
+    //Quantities: 1..125 read, 1..121 written, byte count twice the writes
+    EXPECT(mb, "FC23 read 0",
+           PDU(0x17, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x00, 0x00),
+           {0x97, 0x03});
+    EXPECT(mb, "FC23 read 126",
+           PDU(0x17, 0x00, 0x00, 0x00, 0x7E, 0x00, 0x00, 0x00, 0x01, 0x02, 0x00, 0x00),
+           {0x97, 0x03});
+    EXPECT(mb, "FC23 write 0",
+           PDU(0x17, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00),
+           {0x97, 0x03});
+    EXPECT(mb, "FC23 write 122",
+           PDU(0x17, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x7A, 0xF4),
+           {0x97, 0x03});
+    EXPECT(mb, "FC23 byte count",
+           PDU(0x17, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x04, 0x00, 0x00),
+           {0x97, 0x03});
+    EXPECT(mb, "FC23 short",
+           PDU(0x17, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x02, 0x04, 0x00, 0x00, 0x00),
+           {0x97, 0x03});
+
+    //Addresses: the whole write range, the read start (as FC03)
+    EXPECT(mb, "FC23 write past end",
+           PDU(0x17, 0x00, 0x00, 0x00, 0x01, 0x00, 0x09, 0x00, 0x02, 0x04, 0x55, 0x55, 0x55, 0x55),
+           {0x97, 0x02});
+    EXPECT(mb, "FC23 read address",
+           PDU(0x17, 0x00, 0x0A, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x02, 0x55, 0x55),
+           {0x97, 0x02});
+    EXPECT(mb, "FC23 nothing written", PDU(0x03, 0x00, 0x00, 0x00, 0x01),
+           {0x03, 0x02, 0x00, 0x00});
+    EXPECT(mb, "FC23 nothing written", PDU(0x03, 0x00, 0x09, 0x00, 0x01),
+           {0x03, 0x02, 0x09, 0x09});
+}
+
+//FC22, result = (current AND and) OR (or AND NOT and), reply is the echo
+static void testMaskWriteRegister() {
+    TestModbus mb;
+    mb.addHreg(0, 0x0012);
+    mb.addHreg(1, 0xFFFF);
+    mb.addHreg(3);
+
+    //The example of the spec
+    EXPECT(mb, "FC22 spec example", PDU(0x16, 0x00, 0x00, 0x00, 0xF2, 0x00, 0x25),
+           {0x16, 0x00, 0x00, 0x00, 0xF2, 0x00, 0x25});
+    if (mb.reply() != MB_REPLY_ECHO) fail("FC22", "reply is not the echo");
+    if (mb.Hreg(0) != 0x0017) fail("FC22 spec example", "wrong result");
+
+    //AND 0 with OR sets the register to OR, AND FFFF leaves it alone
+    EXPECT(mb, "FC22 and 0", PDU(0x16, 0x00, 0x01, 0x00, 0x00, 0x12, 0x34),
+           {0x16, 0x00, 0x01, 0x00, 0x00, 0x12, 0x34});
+    if (mb.Hreg(1) != 0x1234) fail("FC22 and 0", "wrong result");
+    EXPECT(mb, "FC22 and FFFF", PDU(0x16, 0x00, 0x01, 0xFF, 0xFF, 0xAB, 0xCD),
+           {0x16, 0x00, 0x01, 0xFF, 0xFF, 0xAB, 0xCD});
+    if (mb.Hreg(1) != 0x1234) fail("FC22 and FFFF", "wrong result");
+
+    //Clear bit 4, set bit 0 of the same register in one transaction
+    EXPECT(mb, "FC22 bit update", PDU(0x16, 0x00, 0x01, 0xFF, 0xEE, 0x00, 0x01),
+           {0x16, 0x00, 0x01, 0xFF, 0xEE, 0x00, 0x01});
+    if (mb.Hreg(1) != 0x1225) fail("FC22 bit update", "wrong result");
+
+    EXPECT(mb, "FC22 hole", PDU(0x16, 0x00, 0x02, 0x00, 0x00, 0x00, 0x01),
+           {0x96, 0x02});
+    EXPECT(mb, "FC22 past end", PDU(0x16, 0x00, 0x04, 0x00, 0x00, 0x00, 0x01),
+           {0x96, 0x02});
+    EXPECT(mb, "FC22 short", PDU(0x16, 0x00, 0x00, 0x00, 0x00, 0x00),
+           {0x96, 0x03});
+}
+
+//FC24 returns the whole FIFO, one holding more than 31 values is an
+//illegal data value
+static void testReadFifoQueue() {
+    TestModbus mb;
+    word data[64];
+    TRegFifo fifo = {data, 63, 0, 0, 0};
+    if (!mb.addFifo(0x04DE, &fifo)) fail("addFifo", "failed");
+
+    EXPECT(mb, "FC24 empty", PDU(0x18, 0x04, 0xDE),
+           {0x18, 0x00, 0x02, 0x00, 0x00});
+    data[0] = 0x01B8;
+    data[1] = 0x1284;
+    fifo.head = 2;
+    EXPECT(mb, "FC24 spec example", PDU(0x18, 0x04, 0xDE),
+           {0x18, 0x00, 0x06, 0x00, 0x02, 0x01, 0xB8, 0x12, 0x84});
+    if (fifo.tail != 2) fail("FC24 spec example", "FIFO not drained");
+
+    for (word i = 0; i < 32; i++) data[(2 + i) & 63] = i;
+    fifo.head = 2 + 32;
+    EXPECT(mb, "FC24 32 queued", PDU(0x18, 0x04, 0xDE), {0x98, 0x03});
+    if (fifo.tail != 2) fail("FC24 32 queued", "FIFO drained");
+    fifo.head = 2 + 31;
+    const byte req[] = {0x18, 0x04, 0xDE};
+    if (mb.request(req, sizeof(req)) != 5 + 31 * 2 ||
+        mb.buf[4] != 31 || mb.buf[5 + 30 * 2 + 1] != 30)
+        fail("FC24 31 queued", "bad reply");
+
+    EXPECT(mb, "FC24 no FIFO", PDU(0x18, 0x04, 0xDF), {0x98, 0x02});
+    EXPECT(mb, "FC24 long", PDU(0x18, 0x04, 0xDE, 0x00), {0x98, 0x03});
+}
+
+//0x42 returns the registers stamped after since, all of them when since
+//cannot be compared
+static void testReadChanges() {
+    TestModbus mb;
+    mb.setEpoch(7);
+    for (word i = 0; i < 4; i++) mb.addIreg(i, 0x0100);
+    mb.commit();
+
+    //Sequence 1 stamped everything, a change to 2 makes sequence 2
+    mb.Ireg(2, 0x0222);
+    mb.commit();
+    EXPECT(mb, "0x42 since 1", PDU(0x42, 0x00, 0x00, 0x00, 0x04, 0x04, 0x00, 0x07, 0x00, 0x01),
+           {0x42, 0x00, 0x07, 0x00, 0x02, 0x00, 0x00, 0x01, 0x00, 0x02, 0x02, 0x22});
+    EXPECT(mb, "0x42 since now", PDU(0x42, 0x00, 0x00, 0x00, 0x04, 0x04, 0x00, 0x07, 0x00, 0x02),
+           {0x42, 0x00, 0x07, 0x00, 0x02, 0x00, 0x00, 0x00});
+    EXPECT(mb, "0x42 other epoch", PDU(0x42, 0x00, 0x01, 0x00, 0x02, 0x04, 0x00, 0x06, 0x00, 0x02),
+           {0x42, 0x00, 0x07, 0x00, 0x02, 0x00, 0x01, 0x02,
+            0x00, 0x01, 0x01, 0x00, 0x00, 0x02, 0x02, 0x22});
+    EXPECT(mb, "0x42 since ahead", PDU(0x42, 0x00, 0x03, 0x00, 0x01, 0x04, 0x00, 0x07, 0x00, 0x03),
+           {0x42, 0x00, 0x07, 0x00, 0x02, 0x00, 0x03, 0x01, 0x00, 0x03, 0x01, 0x00});
+    EXPECT(mb, "0x42 bad table", PDU(0x42, 0x00, 0x00, 0x00, 0x01, 0x03, 0x00, 0x07, 0x00, 0x00),
+           {0xC2, 0x03});
+    EXPECT(mb, "0x42 past end", PDU(0x42, 0x00, 0x03, 0x00, 0x02, 0x04, 0x00, 0x07, 0x00, 0x00),
+           {0xC2, 0x02});
+
+    //Two deadbands, each range keeps its own
+    mb.deadband(0, 1, 0x10);
+    mb.deadband(1, 1, 0x40);
+    mb.Ireg(0, 0x0120);
+    mb.Ireg(1, 0x0120);
+    mb.commit();
+    EXPECT(mb, "0x42 deadbands", PDU(0x42, 0x00, 0x00, 0x00, 0x02, 0x04, 0x00, 0x07, 0x00, 0x02),
+           {0x42, 0x00, 0x07, 0x00, 0x03, 0x00, 0x00, 0x01, 0x00, 0x00, 0x01, 0x20});
+
+    //Past the wrap of the sequence, a register left alone never looks recent
+    for (long n = 0; n < 70000; n++) {
+        mb.Ireg(0, n & 1 ? 0x0100 : 0x0200);
+        mb.commit();
+    }
+    byte now[] = {0x42, 0x00, 0x00, 0x00, 0x01, 0x04, 0x00, 0x07, 0x00, 0x00};
+    mb.request(now, sizeof(now));
+    word seq = mb.buf[3] << 8 | mb.buf[4];
+    //One more than the commits, sequence 0 is skipped
+    if (seq != (word)(3 + 70000 + 1)) fail("0x42 wrap", "wrong sequence");
+    byte since[] = {0x42, 0x00, 0x00, 0x00, 0x04, 0x04, 0x00, 0x07, (byte)((seq - 1) >> 8), (byte)(seq - 1)};
+    if (mb.request(since, sizeof(since)) != 8 + 4 || mb.buf[7] != 1 || mb.buf[9] != 0x00)
+        fail("0x42 wrap", "stale register reported");
+
+    //A range that does not fit one reply continues at next, the last reply
+    //of a range ending at 65535 gives start back instead of 0. The ends go
+    //first so the bank is allocated once.
+    TestModbus top;
+    top.addIreg(0xFFC0, 0xFFC0);
+    for (long i = 0xFFFF; i > 0xFFC0; i--) top.addIreg(i, i);
+    top.commit();
+    byte all[] = {0x42, 0xFF, 0xC0, 0x00, 0x40, 0x04, 0x00, 0x00, 0x00, 0x00};
+    word maxpairs = (MAX_PDU - 8) / 4;
+    if (top.request(all, sizeof(all)) != 8 + maxpairs * 4 || top.buf[7] != maxpairs ||
+        (top.buf[5] << 8 | top.buf[6]) != 0xFFC0 + maxpairs)
+        fail("0x42 truncated", "bad next");
+    all[1] = top.buf[5];
+    all[2] = top.buf[6];
+    all[4] = 0x40 - maxpairs;
+    if (top.request(all, sizeof(all)) != 8 + (0x40 - maxpairs) * 4 ||
+        (top.buf[5] << 8 | top.buf[6]) != 0xFFC0 + maxpairs ||
+        (top.buf[4 + (0x40 - maxpairs) * 4] << 8 | top.buf[5 + (0x40 - maxpairs) * 4]) != 0xFFFF)
+        fail("0x42 end of range", "bad next");
+}
+
+//Scan driven by the scheduler: each input task writes the number of the
+//pass into its register, the scan hook commits
+static TestModbus* scanModbus;
+static word scanPass;
+
+static void scanInput0() { scanModbus->Ireg(0, scanPass); }
+static void scanInput1() { scanModbus->Ireg(1, scanPass); }
+static void scanInput2() { scanModbus->Ireg(2, scanPass); }
+static void scanInput3() { scanModbus->Ireg(3, scanPass); }
+static void scanCommit() { scanModbus->commit(); scanPass++; }
+
+//A request served between any two tasks sees one whole pass, of the inputs
+//as of the outputs
+static void testScanImage() {
+    TestModbus mb;
+    for (word i = 0; i < 4; i++) mb.addIreg(i);
+    mb.addHreg(0, 0x1111);
+    mb.addHreg(1, 0x2222);
+    mb.commit();
+
+    Scheduler scheduler;
+    scheduler.begin(0, 0);
+    scheduler.add(scanInput0);
+    scheduler.add(scanInput1);
+    scheduler.add(scanInput2);
+    scheduler.add(scanInput3);
+    scheduler.onScan(scanCommit);
+    scanModbus = &mb;
+    scanPass = 1;
+
+    word last = 0;
+    for (int turn = 0; turn < 50; turn++) {
+        scheduler.run();
+        const byte req[] = {0x04, 0x00, 0x00, 0x00, 0x04};
+        if (mb.request(req, sizeof(req)) != 10) {
+            fail("FC04 scan", "bad reply");
+            break;
+        }
+        word pass = mb.buf[2] << 8 | mb.buf[3];
+        for (word i = 1; i < 4; i++) {
+            if ((mb.buf[2 + 2 * i] << 8 | mb.buf[3 + 2 * i]) != pass)
+                fail("FC04 scan", "reply mixes two passes");
+        }
+        if (pass < last) fail("FC04 scan", "went back a pass");
+        last = pass;
+    }
+    //Five turns a pass, four tasks and the commit
+    if (last != 10) fail("FC04 scan", "commit not on every pass");
+
+    //Written outputs reach the image, and nextDirty(), with the commit
+    word offset = 0;
+    while (mb.nextDirty(MB_TABLE_HREGS, offset)) offset++;
+    EXPECT(mb, "FC16 outputs", PDU(0x10, 0x00, 0x00, 0x00, 0x02, 0x04, 0x12, 0x34, 0x56, 0x78),
+           {0x10, 0x00, 0x00, 0x00, 0x02});
+    offset = 0;
+    if (mb.Image(MB_TABLE_HREGS, 0) != 0x1111 || mb.Image(MB_TABLE_HREGS, 1) != 0x2222 ||
+        mb.nextDirty(MB_TABLE_HREGS, offset))
+        fail("FC16 outputs", "applied before the commit");
+    mb.commit();
+    offset = 0;
+    if (mb.Image(MB_TABLE_HREGS, 0) != 0x1234 || mb.Image(MB_TABLE_HREGS, 1) != 0x5678 ||
+        !mb.nextDirty(MB_TABLE_HREGS, offset) || offset != 0)
+        fail("FC16 outputs", "not applied by the commit");
+}
+
+static void run(void (*test)()) {
+    heapLeft = HEAP_SIZE;
+    test();
+}
+
+int main() {
+    run(testSparse);
+    run(testAllocFailure);
+    run(testExchangeImage);
+    run(testReadWriteRegisters);
+    run(testMaskWriteRegister);
+    run(testReadFifoQueue);
+    run(testReadChanges);
+    run(testScanImage);
+
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,132 @@
+/*
+    test_serial.cpp - Checks the RTU framing of ModbusSerial on the wire
+
+    Built for the host, so the polled receiver runs (no USART interrupt).
+    Each case queues one request ADU in the fake port of Arduino.h, lets
+    t3.5 of silence pass and compares every byte written back.
+*/
+#include <stdio.h>
+#include "ModbusSerial.h"
+
+static HardwareSerial port;
+static int failures = 0;
+
+static void fail(const char* name, const char* why) {
+    printf("FAIL %s: %s\n", name, why);
+    failures++;
+}
+
+//Sends address + pdu with its CRC, returns once the slave has had t3.5
+static void send(ModbusSerial& mb, byte address, const byte* pdu, word len,
+                 word crcError = 0) {
+    byte adu[MAX_FRAME];
+    adu[0] = address;
+    memcpy(adu + 1, pdu, len);
+    word crc = crcBlock(0xFFFF, adu, len + 1) ^ crcError;
+    adu[len + 1] = crc >> 8;
+    adu[len + 2] = crc & 0xFF;
+
+    port.rxHead = port.rxTail = 0;
+    port.txLen = 0;
+    memcpy(port.rx, adu, len + 3);
+    port.rxHead = len + 3;
+    mb.task();
+    hostMicros() += 5000;
+    mb.task();
+}
+
+//Sends the request and compares the reply PDU, an empty one means silence
+static void expect(ModbusSerial& mb, const char* name, byte address,
+                   const byte* pdu, word len, const byte* expected, word explen) {
+    send(mb, address, pdu, len);
+    bool ok;
+    if (!explen) {
+        ok = port.txLen == 0;
+    } else {
+        word crc = crcBlock(0xFFFF, port.tx, port.txLen);
+        ok = port.txLen == explen + 3 && port.tx[0] == mb.getSlaveId() &&
+             !memcmp(port.tx + 1, expected, explen) && crc == 0;
+    }
+    if (!ok) {
+        printf("FAIL %s: got", name);
+        for (word i = 0; i < port.txLen; i++) printf(" %02X", port.tx[i]);
+        printf("\n");
+        failures++;
+    }
+}
+
+#define EXPECT(mb, name, address, pdu, ...) do { \
+    const byte req[] = pdu; \
+    const byte rep[] = __VA_ARGS__; \
+    expect(mb, name, address, req, sizeof(req), rep, sizeof(rep)); \
+} while (0)
+#define SILENT(mb, name, address, pdu) do { \
+    const byte req[] = pdu; \
+    expect(mb, name, address, req, sizeof(req), 0, 0); \
+} while (0)
+#define PDU(...) {__VA_ARGS__}
+
+//Address 0 and group addresses carry writes to every slave that takes
+//them, none of which replies
+static void testBroadcast() {
+    ModbusSerial mb;
+    if (mb.setSlaveId(0)) fail("setSlaveId(0)", "taken");
+    if (mb.setSlaveId(248)) fail("setSlaveId(248)", "taken");
+    if (!mb.setSlaveId(5)) fail("setSlaveId(5)", "refused");
+    if (!mb.addGroup(248)) fail("addGroup(248)", "refused");
+    if (mb.addGroup(0)) fail("addGroup(0)", "taken");
+    if (mb.addGroup(5)) fail("addGroup(5)", "taken");
+    mb.config(&port, 19200, -1);
+    for (word i = 0; i < 4; i++) {
+        mb.addHreg(i);
+        mb.addCoil(i);
+    }
+
+    EXPECT(mb, "unicast FC06", 5, PDU(0x06, 0x00, 0x00, 0x00, 0x01),
+           {0x06, 0x00, 0x00, 0x00, 0x01});
+    EXPECT(mb, "unicast exception", 5, PDU(0x06, 0x00, 0x09, 0x00, 0x01),
+           {0x86, 0x02});
+
+    SILENT(mb, "broadcast FC06", 0, PDU(0x06, 0x00, 0x00, 0x00, 0x02));
+    if (mb.Hreg(0) != 2) fail("broadcast FC06", "not applied");
+    SILENT(mb, "broadcast FC16", 0,
+           PDU(0x10, 0x00, 0x01, 0x00, 0x02, 0x04, 0x00, 0x11, 0x00, 0x22));
+    if (mb.Hreg(1) != 0x11 || mb.Hreg(2) != 0x22) fail("broadcast FC16", "not applied");
+    SILENT(mb, "broadcast FC05", 0, PDU(0x05, 0x00, 0x00, 0xFF, 0x00));
+    if (!mb.Coil(0)) fail("broadcast FC05", "not applied");
+    SILENT(mb, "broadcast FC15", 0, PDU(0x0F, 0x00, 0x01, 0x00, 0x03, 0x01, 0x05));
+    if (!mb.Coil(1) || mb.Coil(2) || !mb.Coil(3)) fail("broadcast FC15", "not applied");
+    SILENT(mb, "broadcast FC22", 0, PDU(0x16, 0x00, 0x00, 0x00, 0x00, 0x00, 0x07));
+    if (mb.Hreg(0) != 7) fail("broadcast FC22", "not applied");
+
+    //Errors stay silent as well, no reply may collide on the bus
+    SILENT(mb, "broadcast exception", 0, PDU(0x06, 0x00, 0x09, 0x00, 0x01));
+
+    //Reads have nothing to answer to, they are not even run
+    SILENT(mb, "broadcast FC03", 0, PDU(0x03, 0x00, 0x00, 0x00, 0x01));
+    SILENT(mb, "broadcast FC23", 0,
+           PDU(0x17, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x02, 0x00, 0x63));
+    if (mb.Hreg(0) != 7) fail("broadcast FC23", "applied");
+
+    SILENT(mb, "group FC06", 248, PDU(0x06, 0x00, 0x03, 0x12, 0x34));
+    if (mb.Hreg(3) != 0x1234) fail("group FC06", "not applied");
+    SILENT(mb, "other group FC06", 249, PDU(0x06, 0x00, 0x03, 0x00, 0x00));
+    SILENT(mb, "other slave FC06", 6, PDU(0x06, 0x00, 0x03, 0x00, 0x00));
+    SILENT(mb, "old broadcast FC06", 0xFF, PDU(0x06, 0x00, 0x03, 0x00, 0x00));
+    if (mb.Hreg(3) != 0x1234) fail("FC06 for others", "applied");
+
+    //A frame with a bad CRC is dropped before the address is looked at
+    const byte fc06[] = {0x06, 0x00, 0x03, 0x00, 0x00};
+    send(mb, 5, fc06, sizeof(fc06), 0x0001);
+    if (port.txLen) fail("bad CRC", "replied");
+    if (mb.Hreg(3) != 0x1234) fail("bad CRC", "applied");
+    EXPECT(mb, "unicast readback", 5, PDU(0x03, 0x00, 0x00, 0x00, 0x04),
+           {0x03, 0x08, 0x00, 0x07, 0x00, 0x11, 0x00, 0x22, 0x12, 0x34});
+}
+
+int main() {
+    testBroadcast();
+
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,105 @@
+/*
+    test_tcp.cpp - Checks the reply bytes of the Modbus/TCP engine in the
+    ESP8266 and Sonoff modbus.h
+
+    Built once per copy, MODBUS_TCP_H names the one under test. Each case
+    sends one request ADU (MBAP header + PDU) through processModbusMessage()
+    and compares the whole reply. The boards have a single holding register.
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include MODBUS_TCP_H
+
+static int failures = 0;
+
+//Sends adu and compares the reply with expected
+static void expect(const char* name, const unsigned char* adu, int len,
+                   const unsigned char* expected, int explen) {
+    unsigned char buf[260];
+    memcpy(buf, adu, len);
+    int reply = processModbusMessage(buf, len);
+    if (reply != explen || memcmp(buf, expected, explen)) {
+        printf("FAIL %s: got", name);
+        for (int i = 0; i < reply; i++) printf(" %02X", buf[i]);
+        printf("\n");
+        failures++;
+    }
+}
+
+#define EXPECT(name, adu, ...) do { \
+    const unsigned char req[] = adu; \
+    const unsigned char rep[] = __VA_ARGS__; \
+    expect(name, req, sizeof(req), rep, sizeof(rep)); \
+} while (0)
+#define ADU(...) {__VA_ARGS__}
+
+//MBAP header: transaction 0x0102, protocol 0, length, unit 1
+#define MBAP(len) 0x01, 0x02, 0x00, 0x00, 0x00, len, 0x01
+
+//FC23, the write is applied before the read
+static void testReadWriteRegisters() {
+    mb_holding_regs[0] = 0;
+    EXPECT("FC23 write then read",
+           ADU(MBAP(13), 0x17, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x02, 0x12, 0x34),
+           {MBAP(5), 0x17, 0x02, 0x12, 0x34});
+    if (mb_holding_regs[0] != 0x1234) { printf("FAIL FC23 write: not applied\n"); failures++; }
+
+    //Quantities: 1..125 read, 1..121 written, byte count twice the writes
+    EXPECT("FC23 read 0",
+           ADU(MBAP(13), 0x17, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x00, 0x00),
+           {MBAP(3), 0x97, 0x03});
+    EXPECT("FC23 read 126",
+           ADU(MBAP(13), 0x17, 0x00, 0x00, 0x00, 0x7E, 0x00, 0x00, 0x00, 0x01, 0x02, 0x00, 0x00),
+           {MBAP(3), 0x97, 0x03});
+    EXPECT("FC23 write 0",
+           ADU(MBAP(11), 0x17, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00),
+           {MBAP(3), 0x97, 0x03});
+    EXPECT("FC23 write 122",
+           ADU(MBAP(11), 0x17, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x7A, 0xF4),
+           {MBAP(3), 0x97, 0x03});
+    EXPECT("FC23 byte count",
+           ADU(MBAP(13), 0x17, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x04, 0x00, 0x00),
+           {MBAP(3), 0x97, 0x03});
+    EXPECT("FC23 short",
+           ADU(MBAP(12), 0x17, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x02, 0x00),
+           {MBAP(3), 0x97, 0x03});
+
+    //Addresses: nothing is written when either range is out
+    EXPECT("FC23 write address",
+           ADU(MBAP(13), 0x17, 0x00, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x01, 0x02, 0x55, 0x55),
+           {MBAP(3), 0x97, 0x02});
+    EXPECT("FC23 read address",
+           ADU(MBAP(13), 0x17, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x02, 0x55, 0x55),
+           {MBAP(3), 0x97, 0x02});
+    if (mb_holding_regs[0] != 0x1234) { printf("FAIL FC23 address: written\n"); failures++; }
+}
+
+//FC22, result = (current AND and) OR (or AND NOT and), reply is the echo
+static void testMaskWriteRegister() {
+    mb_holding_regs[0] = 0x0012;
+    EXPECT("FC22 spec example",
+           ADU(MBAP(8), 0x16, 0x00, 0x00, 0x00, 0xF2, 0x00, 0x25),
+           {MBAP(8), 0x16, 0x00, 0x00, 0x00, 0xF2, 0x00, 0x25});
+    if (mb_holding_regs[0] != 0x0017) { printf("FAIL FC22: wrong result\n"); failures++; }
+
+    EXPECT("FC22 bit update",
+           ADU(MBAP(8), 0x16, 0x00, 0x00, 0x7F, 0xFE, 0x80, 0x00),
+           {MBAP(8), 0x16, 0x00, 0x00, 0x7F, 0xFE, 0x80, 0x00});
+    if (mb_holding_regs[0] != 0x8016) { printf("FAIL FC22 bit update: wrong result\n"); failures++; }
+
+    EXPECT("FC22 address",
+           ADU(MBAP(8), 0x16, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01),
+           {MBAP(3), 0x96, 0x02});
+    EXPECT("FC22 short",
+           ADU(MBAP(7), 0x16, 0x00, 0x00, 0x00, 0x00, 0x00),
+           {MBAP(3), 0x96, 0x03});
+}
+
+int main() {
+    testReadWriteRegisters();
+    testMaskWriteRegister();
+
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}